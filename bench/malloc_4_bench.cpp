@@ -0,0 +1,147 @@
+#include "my_stdlib.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Usage: malloc_4_bench [workload] [iterations]
+// Prints the average time of one operation for every workload, or for the
+// one given on the command line.
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static unsigned long long next_random()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Keeps a window of live power-of-two buffers and replaces a random one
+// every iteration.
+static size_t bench_pow2(size_t iterations)
+{
+    std::vector<void *> live(1024, nullptr);
+    for (size_t i = 0; i < iterations; i++)
+    {
+        size_t slot = next_random() % live.size();
+        sfree(live[slot]);
+        live[slot] = smalloc((size_t)16 << (next_random() % 12));
+    }
+    for (void *p : live)
+    {
+        sfree(p);
+    }
+    return iterations;
+}
+
+// Random sizes up to 4KB, to show the cost of rounding to a power of two.
+static size_t bench_mixed(size_t iterations)
+{
+    std::vector<void *> live(1024, nullptr);
+    for (size_t i = 0; i < iterations; i++)
+    {
+        size_t slot = next_random() % live.size();
+        sfree(live[slot]);
+        live[slot] = smalloc(1 + next_random() % 4096);
+    }
+    for (void *p : live)
+    {
+        sfree(p);
+    }
+    return iterations;
+}
+
+// Allocates and frees the same size over and over.
+static size_t bench_same_size(size_t iterations)
+{
+    for (size_t i = 0; i < iterations; i++)
+    {
+        void *p = smalloc(64);
+        sfree(p);
+    }
+    return iterations;
+}
+
+// Builds a linked list of small nodes in random order, then walks it. Almost
+// every step touches a different page, so the walk is bound by TLB misses
+// and shows whether the heap ends up backed by huge pages.
+static size_t bench_pointer_chase(size_t iterations)
+{
+    struct Node
+    {
+        Node *next;
+        size_t value;
+    };
+    const size_t count = (size_t)1 << 19;
+    std::vector<Node *> allocated(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        allocated[i] = (Node *)smalloc(sizeof(Node));
+    }
+    std::vector<Node *> nodes(allocated);
+    for (size_t i = count - 1; i > 0; i--)
+    {
+        std::swap(nodes[i], nodes[next_random() % (i + 1)]);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        nodes[i]->next = nodes[(i + 1) % count];
+        nodes[i]->value = i;
+    }
+
+    Node *node = nodes[0];
+    size_t sum = 0;
+    for (size_t i = 0; i < iterations; i++)
+    {
+        sum += node->value;
+        node = node->next;
+    }
+    volatile size_t sink = sum;
+    (void)sink;
+
+    // In address order, so every block merges with the one before it
+    for (Node *p : allocated)
+    {
+        sfree(p);
+    }
+    return iterations;
+}
+
+struct Workload
+{
+    const char *name;
+    size_t (*run)(size_t iterations);
+};
+
+static const Workload workloads[] = {
+    {"pow2", bench_pow2},
+    {"mixed", bench_mixed},
+    {"same_size", bench_same_size},
+    {"pointer_chase", bench_pointer_chase},
+};
+
+int main(int argc, char **argv)
+{
+    const char *only = argc > 1 ? argv[1] : nullptr;
+    size_t iterations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 200000;
+
+    for (const Workload &workload : workloads)
+    {
+        if (only != nullptr && std::strcmp(only, workload.name) != 0)
+        {
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        size_t ops = workload.run(iterations);
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        std::printf("%-12s %10.1f ns/op  (allocated blocks %zu, free blocks %zu)\n", workload.name, ns / ops,
+                    _num_allocated_blocks(), _num_free_blocks());
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Usage: malloc_4_copy_bench [max_size]
+// Compares the copy engine that srealloc moves blocks with against libc
+// memmove, in GB/s, for sizes from 64B up to max_size (100MB by default).
+// "overlap" copies to 64 bytes below the source, like a move into a free
+// previous block.
+
+void copyMemory(void *dst, const void *src, size_t n);
+
+typedef void *(*CopyFunction)(void *dst, const void *src, size_t n);
+
+static void *engine_copy(void *dst, const void *src, size_t n)
+{
+    copyMemory(dst, src, n);
+    return dst;
+}
+
+static void *libc_copy(void *dst, const void *src, size_t n)
+{
+    return memmove(dst, src, n);
+}
+
+// Repeats the copy until about 1GB has been moved, at least 3 times.
+static double measure(CopyFunction copy, char *dst, const char *src, size_t n)
+{
+    size_t repeats = ((size_t)1 << 30) / n;
+    if (repeats < 3)
+    {
+        repeats = 3;
+    }
+    copy(dst, src, n);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; i++)
+    {
+        copy(dst, src, n);
+    }
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return (double)n * repeats / seconds / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t max_size = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000000;
+    // One buffer holds both ends of the disjoint copy, the overlapping one
+    // reuses its start.
+    char *buffer = (char *)std::malloc(2 * max_size + 64);
+    if (buffer == nullptr)
+    {
+        return 1;
+    }
+    std::memset(buffer, 1, 2 * max_size + 64);
+    char *src = buffer + 64;
+    char *dst = buffer + max_size + 64;
+
+    std::printf("%12s %12s %12s %12s %12s\n", "size", "memmove", "engine", "overlap_mm", "overlap_eng");
+    for (size_t n = 64;; n *= 4)
+    {
+        if (n > max_size)
+        {
+            n = max_size;
+        }
+        std::printf("%12zu %12.2f %12.2f %12.2f %12.2f\n", n,
+                    measure(libc_copy, dst, src, n),
+                    measure(engine_copy, dst, src, n),
+                    measure(libc_copy, buffer, src, n),
+                    measure(engine_copy, buffer, src, n));
+        if (n == max_size)
+        {
+            break;
+        }
+    }
+    std::free(buffer);
+    return 0;
+}
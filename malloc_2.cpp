@@ -5,6 +5,16 @@
 
 #define MAX_SIZE 100000000
 
+// All the statistics, taken at once, like mallinfo2.
+struct smallinfo{
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t meta_data_bytes;
+    size_t size_meta_data;
+};
+
 class MallocMetadata{
 public:
     size_t size;
@@ -19,6 +29,12 @@ public:
 class AllocedBlocksList{
     public:
         MallocMetadata* head;
+        // Kept up to date by every path that changes a block, so the
+        // statistics don't walk the list.
+        size_t stat_free_blocks;
+        size_t stat_free_bytes;
+        size_t stat_allocated_blocks;
+        size_t stat_allocated_bytes;
         AllocedBlocksList() = default;
         ~AllocedBlocksList() = default;
     
@@ -55,6 +71,8 @@ void* AllocedBlocksList::insertBlock(size_t size)
     new_block->size = size;
     new_block->next = NULL;
     new_block->prev = NULL;
+    stat_allocated_blocks++;
+    stat_allocated_bytes += size;
 
     if (head == NULL) {
         head = new_block;
@@ -81,6 +99,8 @@ void* AllocedBlocksList::allocateFreeBlock(size_t size){
     while (temp != NULL) {
         if(temp->is_free == 1 && temp->size >= size){
             temp->is_free = 0;
+            stat_free_blocks--;
+            stat_free_bytes -= temp->size;
             return meta_to_data(temp);
         }
         temp = temp->next;
@@ -94,54 +114,24 @@ void AllocedBlocksList::releaseBlock(void* ptr){
         return;
     }
     meta_data_ptr->is_free = 1;
+    stat_free_blocks++;
+    stat_free_bytes += meta_data_ptr->size;
 }
 
 size_t AllocedBlocksList::num_free_blocks() {
-    size_t free_blocks = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        if(temp->is_free == 1) {
-            free_blocks++;
-        }
-        temp = temp->next;
-    }
-    return free_blocks;
+    return stat_free_blocks;
 }
 
 size_t AllocedBlocksList::num_free_bytes() {
-    size_t free_bytes = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        if(temp->is_free == 1) {
-            free_bytes += temp->size;
-        }
-        temp = temp->next;
-    }
-    return free_bytes;
+    return stat_free_bytes;
 }
 
 size_t AllocedBlocksList::num_allocated_blocks() {
-    size_t alloced_blocks = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        alloced_blocks++;
-        temp = temp->next;
-    }
-    return alloced_blocks;
+    return stat_allocated_blocks;
 }
 
 size_t AllocedBlocksList::num_allocated_bytes() {
-    size_t alloced_bytes = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        alloced_bytes += temp->size;
-        temp = temp->next;
-    }
-    return alloced_bytes;
+    return stat_allocated_bytes;
 }
 
 size_t AllocedBlocksList::num_meta_data_bytes() {
@@ -242,6 +232,17 @@ size_t _size_meta_data(){
     return allocatedBlocks.size_meta_data();
 }
 
+struct smallinfo smallinfo(){
+    struct smallinfo info;
+    info.free_blocks = allocatedBlocks.num_free_blocks();
+    info.free_bytes = allocatedBlocks.num_free_bytes();
+    info.allocated_blocks = allocatedBlocks.num_allocated_blocks();
+    info.allocated_bytes = allocatedBlocks.num_allocated_bytes();
+    info.meta_data_bytes = allocatedBlocks.num_meta_data_bytes();
+    info.size_meta_data = allocatedBlocks.size_meta_data();
+    return info;
+}
+
 
 // int main(){
 //     void *base = sbrk(0);
@@ -2,13 +2,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <cstring>
+#include <stdint.h>
 #include <sys/mman.h>
 
 #define MAX_SIZE 100000000
 #define LARGE_BLOCK 128 * 1024
 #define MIN_SPLIT_SIZE 128
 #define DEADBEEF 0xdeadbeef
-
+#define FREE_TREE_MAX_DEPTH 128
+
+// All the statistics, taken at once, like mallinfo2.
+struct smallinfo{
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t meta_data_bytes;
+    size_t size_meta_data;
+};
 
 /***************************************************/
 /************* Malloc Functions Headers*************/
@@ -18,11 +29,20 @@ void  sfree(void* p);
 void* srealloc(void* oldp, size_t size);
 /***************************************************/
 
+// The size, the flags and a short cookie share one word. Free heap blocks
+// use next and prev as the children in the free tree, mmapped blocks as
+// their list links.
 class MallocMetadata{
 public:
-    int cookie;
-    size_t size;
-    bool is_free;
+    uint64_t size : 44;
+    uint64_t is_free : 1;
+    uint64_t is_last : 1;
+    // The payload is known to be all zero, as it came from the OS and
+    // hasn't been handed out since
+    uint64_t is_zero : 1;
+    uint64_t is_red : 1;
+    uint64_t cookie : 16;
+    size_t prev_size;
     MallocMetadata* next;
     MallocMetadata* prev;
 
@@ -30,24 +50,267 @@ public:
     MallocMetadata(size_t size) : size(size), is_free(false) {};
 };
  
+// Red-black tree of free blocks ordered by (size, address), so the first
+// block of at least some size is the best fit, with ties going to the lowest
+// address. There are no parent links, the path from the root is kept on the
+// stack instead.
+class FreeTree{
+public:
+    static void Insert(MallocMetadata** root, MallocMetadata* block);
+    static void Remove(MallocMetadata** root, MallocMetadata* block);
+    static MallocMetadata* LowerBound(MallocMetadata* root, size_t size);
+
+private:
+    static bool IsRed(MallocMetadata* node);
+    static bool Less(MallocMetadata* a, MallocMetadata* b);
+    static void Replace(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node, MallocMetadata* child);
+    static void RotateLeft(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node);
+    static void RotateRight(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node);
+};
+
+bool FreeTree::IsRed(MallocMetadata* node){
+    return node != NULL && node->is_red;
+}
+
+bool FreeTree::Less(MallocMetadata* a, MallocMetadata* b){
+    return a->size < b->size || (a->size == b->size && a < b);
+}
+
+// Puts child in the place of node, below parent or at the root.
+void FreeTree::Replace(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node, MallocMetadata* child){
+    if(parent == NULL){
+        *root = child;
+    }
+    else if(parent->next == node){
+        parent->next = child;
+    }
+    else{
+        parent->prev = child;
+    }
+}
+
+void FreeTree::RotateLeft(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node){
+    MallocMetadata* right = node->prev;
+    node->prev = right->next;
+    right->next = node;
+    Replace(root, parent, node, right);
+}
+
+void FreeTree::RotateRight(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node){
+    MallocMetadata* left = node->next;
+    node->next = left->prev;
+    left->prev = node;
+    Replace(root, parent, node, left);
+}
+
+void FreeTree::Insert(MallocMetadata** root, MallocMetadata* block){
+    MallocMetadata* path[FREE_TREE_MAX_DEPTH];
+    int depth = 0;
+    for(MallocMetadata* curr = *root; curr != NULL; curr = Less(block, curr) ? curr->next : curr->prev){
+        path[depth++] = curr;
+    }
+
+    block->next = NULL;
+    block->prev = NULL;
+    block->is_red = 1;
+    if(depth == 0){
+        *root = block;
+    }
+    else if(Less(block, path[depth - 1])){
+        path[depth - 1]->next = block;
+    }
+    else{
+        path[depth - 1]->prev = block;
+    }
+
+    // Fix a red node below a red parent, which is never the root
+    MallocMetadata* node = block;
+    while(depth > 0 && IsRed(path[depth - 1])){
+        MallocMetadata* parent = path[depth - 1];
+        MallocMetadata* grand = path[depth - 2];
+        MallocMetadata* great = depth > 2 ? path[depth - 3] : NULL;
+        bool parent_is_left = grand->next == parent;
+        MallocMetadata* uncle = parent_is_left ? grand->prev : grand->next;
+        if(IsRed(uncle)){
+            parent->is_red = 0;
+            uncle->is_red = 0;
+            grand->is_red = 1;
+            node = grand;
+            depth -= 2;
+            continue;
+        }
+        if(parent_is_left){
+            if(parent->prev == node){
+                RotateLeft(root, grand, parent);
+                parent = node;
+            }
+            RotateRight(root, great, grand);
+        }
+        else{
+            if(parent->next == node){
+                RotateRight(root, grand, parent);
+                parent = node;
+            }
+            RotateLeft(root, great, grand);
+        }
+        parent->is_red = 0;
+        grand->is_red = 1;
+        break;
+    }
+    (*root)->is_red = 0;
+}
+
+void FreeTree::Remove(MallocMetadata** root, MallocMetadata* block){
+    MallocMetadata* path[FREE_TREE_MAX_DEPTH];
+    int depth = 0;
+    MallocMetadata* curr = *root;
+    while(curr != block){
+        if(curr == NULL){
+            exit(DEADBEEF);
+        }
+        path[depth++] = curr;
+        curr = Less(block, curr) ? curr->next : curr->prev;
+    }
+
+    // A block with two children first trades places with the next block in
+    // order, which has no left child.
+    if(block->next != NULL && block->prev != NULL){
+        int block_depth = depth;
+        path[depth++] = block;
+        MallocMetadata* next = block->prev;
+        while(next->next != NULL){
+            path[depth++] = next;
+            next = next->next;
+        }
+        MallocMetadata* next_right = next->prev;
+        bool next_is_red = next->is_red;
+        Replace(root, block_depth > 0 ? path[block_depth - 1] : NULL, block, next);
+        next->next = block->next;
+        if(block->prev == next){
+            next->prev = block;
+        }
+        else{
+            next->prev = block->prev;
+            path[depth - 1]->next = block;
+        }
+        next->is_red = block->is_red;
+        path[block_depth] = next;
+        block->next = NULL;
+        block->prev = next_right;
+        block->is_red = next_is_red;
+    }
+
+    MallocMetadata* parent = depth > 0 ? path[depth - 1] : NULL;
+    MallocMetadata* node = block->next != NULL ? block->next : block->prev;
+    Replace(root, parent, block, node);
+    block->next = NULL;
+    block->prev = NULL;
+    if(block->is_red){
+        return;
+    }
+
+    // Taking out a black block leaves node one black short. Its sibling
+    // can't be empty then, even when node is.
+    while(depth > 0 && !IsRed(node)){
+        parent = path[depth - 1];
+        MallocMetadata* grand = depth > 1 ? path[depth - 2] : NULL;
+        bool node_is_left = parent->next == node;
+        MallocMetadata* sibling = node_is_left ? parent->prev : parent->next;
+        if(IsRed(sibling)){
+            sibling->is_red = 0;
+            parent->is_red = 1;
+            if(node_is_left){
+                RotateLeft(root, grand, parent);
+            }
+            else{
+                RotateRight(root, grand, parent);
+            }
+            path[depth - 1] = sibling;
+            path[depth++] = parent;
+            grand = sibling;
+            sibling = node_is_left ? parent->prev : parent->next;
+        }
+        MallocMetadata* near = node_is_left ? sibling->next : sibling->prev;
+        MallocMetadata* far = node_is_left ? sibling->prev : sibling->next;
+        if(!IsRed(near) && !IsRed(far)){
+            sibling->is_red = 1;
+            node = parent;
+            depth--;
+            continue;
+        }
+        if(!IsRed(far)){
+            near->is_red = 0;
+            sibling->is_red = 1;
+            if(node_is_left){
+                RotateRight(root, parent, sibling);
+            }
+            else{
+                RotateLeft(root, parent, sibling);
+            }
+            far = sibling;
+            sibling = near;
+        }
+        sibling->is_red = parent->is_red;
+        parent->is_red = 0;
+        far->is_red = 0;
+        if(node_is_left){
+            RotateLeft(root, grand, parent);
+        }
+        else{
+            RotateRight(root, grand, parent);
+        }
+        return;
+    }
+    if(node != NULL){
+        node->is_red = 0;
+    }
+}
+
+// The first block of at least size, NULL if there is none.
+MallocMetadata* FreeTree::LowerBound(MallocMetadata* root, size_t size){
+    MallocMetadata* best = NULL;
+    while(root != NULL){
+        if(root->size >= size){
+            best = root;
+            root = root->next;
+        }
+        else{
+            root = root->prev;
+        }
+    }
+    return best;
+}
+
 class AllocedBlocksList{
     public:
-        MallocMetadata* head;
+        MallocMetadata* free_tree;
         MallocMetadata* head_large;
         MallocMetadata* wilderness_block;
         int cookie_code;
+        // Kept up to date by every path that changes a block, so the
+        // statistics don't walk the lists.
+        size_t stat_free_blocks;
+        size_t stat_free_bytes;
+        size_t stat_allocated_blocks;
+        size_t stat_allocated_bytes;
 
         AllocedBlocksList();
         ~AllocedBlocksList() = default;
     
         void* insertBlock(size_t size, MallocMetadata* block = nullptr);
         void* allocateFreeBlock(size_t size);
+        void* handOutBlock(void* block, size_t size, int is_scalloc);
         void releaseBlock(void* ptr);
         void releaseRegularBlock(void* ptr);
         void* SplitAndInsert(size_t new_size, MallocMetadata* old_block);
         void RemoveBlock(MallocMetadata* block);
+        void SetFree(MallocMetadata* block, bool is_free);
+        MallocMetadata* NextPhysical(MallocMetadata* block);
+        MallocMetadata* PrevPhysical(MallocMetadata* block);
         MallocMetadata* GetNextIfFree(MallocMetadata* ptr);
         MallocMetadata* GetPrevIfFree(MallocMetadata* ptr);
+        void MergeBlocks(MallocMetadata* first, MallocMetadata* second);
+        bool ExtendWilderness(size_t size);
         void UnionAndInsert(MallocMetadata* curr, MallocMetadata* next, MallocMetadata* prev, bool isfree = 1);
         void* insertLargeBlock(size_t size);
         void releaseLargeBlock(void* ptr);
@@ -66,7 +329,8 @@ class AllocedBlocksList{
         void* meta_to_data(MallocMetadata* p);
 };
 
-AllocedBlocksList::AllocedBlocksList() : head(nullptr), head_large(nullptr), wilderness_block(nullptr), cookie_code(rand()){}
+AllocedBlocksList::AllocedBlocksList() : free_tree(nullptr), head_large(nullptr), wilderness_block(nullptr), cookie_code(rand() & 0xffff),
+                                         stat_free_blocks(0), stat_free_bytes(0), stat_allocated_blocks(0), stat_allocated_bytes(0){}
 
 MallocMetadata* AllocedBlocksList::data_to_meta(void* p){
     MallocMetadata* meta_data_ptr = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
@@ -91,120 +355,130 @@ void AllocedBlocksList::VerifyCookieCode(MallocMetadata* block){
 void* AllocedBlocksList::insertBlock(size_t size, MallocMetadata* new_block)
 {   
     if (new_block == nullptr) {
-        if (wilderness_block != nullptr && wilderness_block->is_free) {
+        if (wilderness_block != nullptr && wilderness_block->is_free && ExtendWilderness(size)) {
             RemoveBlock(wilderness_block);
-            sbrk(size - wilderness_block->size);
-            wilderness_block->size += size - wilderness_block->size;
             new_block = wilderness_block;
         } else {
+            char* heap_end = wilderness_block == nullptr ? nullptr : (char*)wilderness_block + size_meta_data() + wilderness_block->size;
             new_block = (MallocMetadata*)sbrk(size_meta_data() + size);
             if(new_block == (void*)-1) {
                 return NULL;
             }
+            // If someone else moved the program break, the old wilderness
+            // is no longer followed by our memory.
+            new_block->prev_size = 0;
+            new_block->is_last = 0;
+            new_block->is_zero = 1;
+            if (wilderness_block != nullptr) {
+                if ((char*)new_block == heap_end) {
+                    new_block->prev_size = wilderness_block->size;
+                } else {
+                    wilderness_block->is_last = 1;
+                }
+            }
             wilderness_block = new_block;
         }
     }
-    VerifyCookieCode(head);
-
     new_block->cookie = this->cookie_code;
     new_block->is_free = 0;
     new_block->size = size;
     new_block->next = NULL;
     new_block->prev = NULL;
+    stat_allocated_blocks++;
+    stat_allocated_bytes += size;
 
-    if (head == NULL) {
-        head = new_block;
-        return meta_to_data(head);
+    MallocMetadata* next_block = NextPhysical(new_block);
+    if (next_block != NULL) {
+        next_block->prev_size = new_block->size;
     }
-    
-    if (head->size > new_block->size) {
-        new_block->next = head;
-        head->prev = new_block;
-        head = new_block;
 
-        return meta_to_data(head);
-    }
-    if (head->size == new_block->size && head > new_block) {
-        new_block->next = head;
-        head->prev = new_block;
-        head = new_block;
+    return meta_to_data(new_block);
+}
 
-        return meta_to_data(head);
-    }
- 
-    MallocMetadata* temp = head;
-    while (temp->next != NULL) {
-        VerifyCookieCode(temp->next);
-        if (temp->next->size > new_block->size) {
-            temp->next->prev = new_block;
-            new_block->next = temp->next;
-            new_block->prev = temp;
-            temp->next = new_block;
-            break;
-        }
-        if (temp->next->size == new_block->size && temp->next > new_block) {
-            temp->next->prev = new_block;
-            new_block->next = temp->next;
-            new_block->prev = temp;
-            temp->next = new_block;
-            break;
-        }
-        temp = temp->next;
-        VerifyCookieCode(temp->next);
+// Zeroes the block for scalloc unless it is known to be zero already. Once
+// handed out it may be written to, so it stops being known zero.
+void* AllocedBlocksList::handOutBlock(void* block, size_t size, int is_scalloc){
+    if(block == NULL){
+        return NULL;
     }
-    
-    if (temp->next == NULL) {
-        temp->next = new_block;
-        new_block->prev = temp;
+    MallocMetadata* meta_data_ptr = data_to_meta(block);
+    if(is_scalloc && !meta_data_ptr->is_zero){
+        std::memset(block, 0, size);
     }
-    
-    return meta_to_data(new_block);
+    meta_data_ptr->is_zero = 0;
+    return block;
 }
 
 void* AllocedBlocksList::allocateFreeBlock(size_t size){
-    MallocMetadata* temp = this->head;
+    MallocMetadata* block = FreeTree::LowerBound(free_tree, size);
+    if (block == NULL) {
+        return NULL;
+    }
+    VerifyCookieCode(block);
+    SetFree(block, 0);
+    return meta_to_data(block);
+}
 
-    if (temp == NULL) {
+MallocMetadata* AllocedBlocksList::NextPhysical(MallocMetadata* block) {
+    // The wilderness block ends the heap, and is_last marks a block that
+    // is followed by memory we don't own.
+    if (block == wilderness_block || block->is_last) {
         return NULL;
     }
- 
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        if(temp->is_free == 1 && temp->size >= size){
-            temp->is_free = 0;
-            return meta_to_data(temp);
-        }
-        temp = temp->next;
+    return (MallocMetadata*)((char*)block + block->size + size_meta_data());
+}
+
+MallocMetadata* AllocedBlocksList::PrevPhysical(MallocMetadata* block) {
+    if (block->prev_size == 0) {
+        return NULL;
     }
-    return NULL;
+    return (MallocMetadata*)((char*)block - block->prev_size - size_meta_data());
 }
 
 MallocMetadata* AllocedBlocksList::GetNextIfFree(MallocMetadata* ptr) {
-    // Find ptr + size + metadata_size
     VerifyCookieCode(ptr);
-    MallocMetadata* curr = this->head;
-    while (curr != NULL) {
-        VerifyCookieCode(curr);
-        if((char*)curr == (char*)ptr + ptr->size + size_meta_data()) {
-            return curr->is_free ? curr : nullptr;
-        }
-        curr = curr->next;
-    }
-    return nullptr;
+    MallocMetadata* next = NextPhysical(ptr);
+    VerifyCookieCode(next);
+    return (next != NULL && next->is_free) ? next : nullptr;
 }
 
 MallocMetadata* AllocedBlocksList::GetPrevIfFree(MallocMetadata* ptr) {
-    // Find curr + curr_size + metadata_size == ptr
     VerifyCookieCode(ptr);
-    MallocMetadata* curr = this->head;
-    while (curr != NULL) {
-        VerifyCookieCode(curr);
-        if((char*)curr + curr->size + size_meta_data() == (char*)ptr) {
-            return curr->is_free ? curr : nullptr;
-        }
-        curr = curr->next;
+    MallocMetadata* prev = PrevPhysical(ptr);
+    VerifyCookieCode(prev);
+    return (prev != NULL && prev->is_free) ? prev : nullptr;
+}
+
+void AllocedBlocksList::MergeBlocks(MallocMetadata* first, MallocMetadata* second) {
+    // Both blocks must already be out of the lists, the caller re-inserts first.
+    first->size += second->size + size_meta_data();
+    first->is_last = second->is_last;
+    if (second == wilderness_block) {
+        wilderness_block = first;
+    }
+    // The header of second becomes payload, clear it to keep first zero.
+    first->is_zero = first->is_zero && second->is_zero;
+    if (first->is_zero) {
+        std::memset(second, 0, size_meta_data());
     }
-    return nullptr;
+}
+
+bool AllocedBlocksList::ExtendWilderness(size_t size) {
+    char* heap_end = (char*)wilderness_block + size_meta_data() + wilderness_block->size;
+    if (sbrk(0) != heap_end) {
+        return false;
+    }
+    if (sbrk(size - wilderness_block->size) == (void*)-1) {
+        return false;
+    }
+
+    // A free wilderness is keyed by its size in the free tree
+    bool was_free = wilderness_block->is_free;
+    SetFree(wilderness_block, 0);
+    stat_allocated_bytes += size - wilderness_block->size;
+    wilderness_block->size = size;
+    SetFree(wilderness_block, was_free);
+    return true;
 }
 
 void AllocedBlocksList::UnionAndInsert(MallocMetadata* curr, MallocMetadata* next, MallocMetadata* prev, bool isfree) {
@@ -221,25 +495,20 @@ void AllocedBlocksList::UnionAndInsert(MallocMetadata* curr, MallocMetadata* nex
 
     switch(situation){
         case 1: // Union curr and next
-            insertBlock(curr->size + next->size + size_meta_data(), curr);
-            curr->is_free = isfree;
-            if (next == wilderness_block) {
-                wilderness_block = curr;
-            }
+            MergeBlocks(curr, next);
+            insertBlock(curr->size, curr);
+            SetFree(curr, isfree);
             break;
         case 2: // Union curr and prev
-            insertBlock(curr->size + prev->size + size_meta_data(), prev);
-            prev->is_free = isfree;
-            if (curr == wilderness_block) {
-                wilderness_block = prev;
-            }
+            MergeBlocks(prev, curr);
+            insertBlock(prev->size, prev);
+            SetFree(prev, isfree);
             break;
         case 3: // Union curr, next and prev
-            insertBlock(prev->size + curr->size + next->size + 2 * size_meta_data(), prev);
-            prev->is_free = isfree;
-            if (next == wilderness_block) {
-                wilderness_block = prev;
-            }
+            MergeBlocks(prev, curr);
+            MergeBlocks(prev, next);
+            insertBlock(prev->size, prev);
+            SetFree(prev, isfree);
             break;
     }
 
@@ -264,7 +533,8 @@ void AllocedBlocksList::releaseRegularBlock(void* ptr){
     if(meta_data_ptr->is_free){
         return;
     }
-    meta_data_ptr->is_free = 1;
+    SetFree(meta_data_ptr, 1);
+    meta_data_ptr->is_zero = 0;
 
     MallocMetadata* next_free = this->GetNextIfFree(meta_data_ptr);
     MallocMetadata* prev_free = this->GetPrevIfFree(meta_data_ptr);
@@ -274,41 +544,54 @@ void AllocedBlocksList::releaseRegularBlock(void* ptr){
     }
 }
 
-void AllocedBlocksList::RemoveBlock(MallocMetadata* block) {
-    VerifyCookieCode(block);
-    if (block->prev == NULL) {
-        head = block->next;
-        if(block->next != NULL){
-        head->prev = NULL;
-        }
-
+// Flips is_free of a block in the heap, moving it in or out of the free
+// tree.
+void AllocedBlocksList::SetFree(MallocMetadata* block, bool is_free) {
+    if (block->is_free == is_free) {
+        return;
+    }
+    block->is_free = is_free;
+    if (is_free) {
+        stat_free_blocks++;
+        stat_free_bytes += block->size;
+        FreeTree::Insert(&free_tree, block);
     } else {
-        VerifyCookieCode(block->prev);
-        VerifyCookieCode(block->next);
-        block->prev->next = block->next;
-        if(block->next!=NULL){
-            block->next->prev = block->prev;
-        }
+        stat_free_blocks--;
+        stat_free_bytes -= block->size;
+        FreeTree::Remove(&free_tree, block);
     }
+}
 
-    block->next = NULL;
-    block->prev = NULL;
+void AllocedBlocksList::RemoveBlock(MallocMetadata* block) {
+    VerifyCookieCode(block);
+    stat_allocated_blocks--;
+    stat_allocated_bytes -= block->size;
+    if (block->is_free) {
+        stat_free_blocks--;
+        stat_free_bytes -= block->size;
+        FreeTree::Remove(&free_tree, block);
+    }
 }
 
 
 void* AllocedBlocksList::SplitAndInsert(size_t new_size, MallocMetadata* old_block) {
     VerifyCookieCode(old_block);
     RemoveBlock(old_block);
-    void* free_block = insertBlock(old_block->size - new_size - size_meta_data(), (MallocMetadata*)((char*)old_block + new_size + size_meta_data()));
+    MallocMetadata* free_block = (MallocMetadata*)((char*)old_block + new_size + size_meta_data());
+    free_block->prev_size = new_size;
+    free_block->is_last = old_block->is_last;
+    free_block->is_zero = old_block->is_zero;
+    old_block->is_last = 0;
     if (old_block == wilderness_block) {
-        wilderness_block = data_to_meta(free_block);
+        wilderness_block = free_block;
     }
-    data_to_meta(free_block)->is_free = 1;
+    insertBlock(old_block->size - new_size - size_meta_data(), free_block);
+    SetFree(free_block, 1);
 
     // Don't merge after split
-    // MallocMetadata* next_free = GetNextIfFree(data_to_meta(free_block));
+    // MallocMetadata* next_free = GetNextIfFree(free_block);
     // if(next_free != NULL){
-    //     UnionAndInsert(data_to_meta(free_block), next_free, NULL);
+    //     UnionAndInsert(free_block, next_free, NULL);
     // }
     insertBlock(new_size, old_block);
     return meta_to_data(old_block);
@@ -323,9 +606,12 @@ void* AllocedBlocksList::insertLargeBlock(size_t size) {
 
     new_large_block->cookie = this->cookie_code;
     new_large_block->is_free = 0;
+    new_large_block->is_zero = 1;
     new_large_block->size = size;
     new_large_block->next = NULL;
     new_large_block->prev = NULL;
+    stat_allocated_blocks++;
+    stat_allocated_bytes += size;
 
     if (head_large == NULL) {
         head_large = new_large_block;
@@ -364,6 +650,8 @@ void AllocedBlocksList::releaseLargeBlock(void* ptr){
 
     meta_data_ptr->next = NULL;
     meta_data_ptr->prev = NULL;
+    stat_allocated_blocks--;
+    stat_allocated_bytes -= meta_data_ptr->size;
 
     munmap(meta_data_ptr, meta_data_ptr->size + size_meta_data());
 }
@@ -383,34 +671,28 @@ void* AllocedBlocksList::ReallocateRegularBlock(MallocMetadata* block, size_t si
         if(block->size + prev->size + size_meta_data() >= size){ // 1.b no wilderness
             RemoveBlock(block);
             RemoveBlock(prev);
-            insertBlock(block->size + prev->size + size_meta_data(), prev);
-            if(block == wilderness_block){
-                wilderness_block = prev;
-            }
+            MergeBlocks(prev, block);
+            insertBlock(prev->size, prev);
+            // Move before splitting, the new free block's header may land inside the old data
+            memmove(meta_to_data(prev), meta_to_data(block), block->size);
             if(prev->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
                 SplitAndInsert(size, prev);
-                // After splitting, we check if we need to update the wilderness_block (that we change to prev in the last if)
-                if(prev == wilderness_block){
-                    wilderness_block = (MallocMetadata*)((char*)prev + size_meta_data() + size);
-                }
             }
-            memmove(meta_to_data(prev), meta_to_data(block), block->size);
             return meta_to_data(prev);
         }
         else if(block == wilderness_block){ // 1.b with wilderness
-            RemoveBlock(block);
-            RemoveBlock(prev);
-            insertBlock(block->size + prev->size + size_meta_data(), prev);
-            wilderness_block = prev;
-            sbrk(size - wilderness_block->size);
-            wilderness_block->size += size - wilderness_block->size;
-            memmove(meta_to_data(prev), meta_to_data(block), block->size);
-            return meta_to_data(prev);
+            size_t old_size = block->size;
+            if(ExtendWilderness(size - prev->size - size_meta_data())){
+                RemoveBlock(block);
+                RemoveBlock(prev);
+                MergeBlocks(prev, block);
+                insertBlock(prev->size, prev);
+                memmove(meta_to_data(prev), meta_to_data(block), old_size);
+                return meta_to_data(prev);
+            }
         }
     }
-    else if(block == wilderness_block){  // 1.c
-        sbrk(size - wilderness_block->size);
-        wilderness_block->size += size - wilderness_block->size;
+    else if(block == wilderness_block && ExtendWilderness(size)){  // 1.c
         return meta_to_data(wilderness_block);
     }
 
@@ -418,16 +700,10 @@ void* AllocedBlocksList::ReallocateRegularBlock(MallocMetadata* block, size_t si
         if(block->size + next->size + size_meta_data() >= size){
             RemoveBlock(block);
             RemoveBlock(next);
-            insertBlock(block->size + next->size + size_meta_data(), block);
-            if(next == wilderness_block){
-                wilderness_block = block;
-            }
+            MergeBlocks(block, next);
+            insertBlock(block->size, block);
             if(block->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
                 SplitAndInsert(size, block);
-                // After splitting, we check if we need to update the wilderness_block (that we change to prev in the last if)
-                if(block == wilderness_block){
-                    wilderness_block = (MallocMetadata*)((char*)block + size_meta_data() + size);
-                }
             }
             return meta_to_data(block);
         }
@@ -439,10 +715,6 @@ void* AllocedBlocksList::ReallocateRegularBlock(MallocMetadata* block, size_t si
             memmove(meta_to_data(prev), meta_to_data(block), block->size);
             if(prev->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
                 SplitAndInsert(size, prev);
-                // After splitting, we check if we need to update the wilderness_block (that we change to prev in the last if)
-                if(prev == wilderness_block){
-                    wilderness_block = (MallocMetadata*)((char*)prev + size_meta_data() + size);
-                }
             }
             return meta_to_data(prev);
         }
@@ -450,21 +722,15 @@ void* AllocedBlocksList::ReallocateRegularBlock(MallocMetadata* block, size_t si
     
     if(next != NULL && next == wilderness_block){ // 1.f
         if(prev != NULL){ // 1.f1
-            UnionAndInsert(block, next, prev, 0);
-            memmove(meta_to_data(prev), meta_to_data(block), block->size);
-
-            wilderness_block = prev;
-            sbrk(size - wilderness_block->size);
-            wilderness_block->size += size - wilderness_block->size;
-            return meta_to_data(wilderness_block);
+            if(ExtendWilderness(size - prev->size - block->size - 2*size_meta_data())){
+                UnionAndInsert(block, next, prev, 0);
+                memmove(meta_to_data(prev), meta_to_data(block), block->size);
+                return meta_to_data(prev);
+            }
         }
-        else{ // 1.f2
+        else if(ExtendWilderness(size - block->size - size_meta_data())){ // 1.f2
             UnionAndInsert(block, next, NULL, 0);
-
-            wilderness_block = block;
-            sbrk(size - wilderness_block->size);
-            wilderness_block->size += size - wilderness_block->size;
-            return meta_to_data(wilderness_block);
+            return meta_to_data(block);
         }
     }
 
@@ -498,71 +764,19 @@ void* AllocedBlocksList::ReallocateLargeBlock(MallocMetadata* oldblock, size_t s
 }
 
 size_t AllocedBlocksList::num_free_blocks() {
-    size_t free_blocks = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        if(temp->is_free == 1) {
-            free_blocks++;
-        }
-        temp = temp->next;
-    }
-    return free_blocks;
+    return stat_free_blocks;
 }
 
 size_t AllocedBlocksList::num_free_bytes() {
-    size_t free_bytes = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        if(temp->is_free == 1) {
-            free_bytes += temp->size;
-        }
-        temp = temp->next;
-    }
-    return free_bytes;
+    return stat_free_bytes;
 }
 
 size_t AllocedBlocksList::num_allocated_blocks() {
-    size_t alloced_blocks = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        alloced_blocks++;
-        temp = temp->next;
-    }
-
-    temp = this->head_large;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        alloced_blocks++;
-        temp = temp->next;
-    }
-    
-    return alloced_blocks;
+    return stat_allocated_blocks;
 }
 
 size_t AllocedBlocksList::num_allocated_bytes() {
-    size_t alloced_bytes = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        alloced_bytes += temp->size;
-        temp = temp->next;
-    }
-
-    temp = this->head_large;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        alloced_bytes += temp->size;
-        temp = temp->next;
-    }
-
-    return alloced_bytes;
+    return stat_allocated_bytes;
 }
 
 size_t AllocedBlocksList::num_meta_data_bytes() {
@@ -582,13 +796,14 @@ size_t AllocedBlocksList::size_meta_data() {
 
 AllocedBlocksList allocatedBlocks = AllocedBlocksList();
 
-void* smalloc(size_t size){
+// Allocates a block, zeroed for scalloc.
+static void* allocate(size_t size, int is_scalloc){
     if(size == 0 || size > MAX_SIZE){
         return NULL;
     }
 
     if (size >= LARGE_BLOCK) {
-        return allocatedBlocks.insertLargeBlock(size);
+        return allocatedBlocks.handOutBlock(allocatedBlocks.insertLargeBlock(size), size, is_scalloc);
     }
 
     void* new_block = allocatedBlocks.allocateFreeBlock(size);
@@ -600,18 +815,16 @@ void* smalloc(size_t size){
         new_block = allocatedBlocks.SplitAndInsert(size, allocatedBlocks.data_to_meta(new_block));
     }
 
-    return new_block;
+    return allocatedBlocks.handOutBlock(new_block, size, is_scalloc);
 }
 
-void* scalloc(size_t num, size_t size){
-    char* new_block = (char*)smalloc(num*size);
-    if(new_block == NULL){
-        return NULL;
-    }
-
-    std::memset(new_block, 0, num*size);
+void* smalloc(size_t size){
+    return allocate(size, 0);
+}
 
-    return new_block;
+void* scalloc(size_t num, size_t size){
+    // Fresh memory from sbrk or mmap is already zero
+    return allocate(num*size, 1);
 }
 
 void sfree(void* p){
@@ -663,3 +876,14 @@ size_t _num_meta_data_bytes(){
 size_t _size_meta_data(){
     return allocatedBlocks.size_meta_data();
 }
+
+struct smallinfo smallinfo(){
+    struct smallinfo info;
+    info.free_blocks = allocatedBlocks.num_free_blocks();
+    info.free_bytes = allocatedBlocks.num_free_bytes();
+    info.allocated_blocks = allocatedBlocks.num_allocated_blocks();
+    info.allocated_bytes = allocatedBlocks.num_allocated_bytes();
+    info.meta_data_bytes = allocatedBlocks.num_meta_data_bytes();
+    info.size_meta_data = allocatedBlocks.size_meta_data();
+    return info;
+}
@@ -4,6 +4,25 @@
 #include <cstring>
 #include <sys/mman.h>
 #include <cassert>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <new>
+#include <sched.h>
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#else
+#define HAVE_RSEQ 0
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if HAVE_RSEQ && defined(__x86_64__)
+#define HAVE_RSEQ_CS 1
+#else
+#define HAVE_RSEQ_CS 0
+#endif
 
 #define MAX_SIZE 100000000
 #define LARGE_BLOCK 128 * 1024
@@ -12,6 +31,208 @@
 #define HUGE_SIZE_MALLOC (1000 * 1000 * 4)
 #define HUGE_SIZE_SCALLOC (1000 * 1000 * 2)
 
+// Two-level segregated fit index: first level is the power of two of the
+// size, second level splits every power of two into TLSF_SL_COUNT ranges.
+// Sizes below TLSF_SMALL_SIZE get one exact bucket per 8-byte size. Every
+// bucket is a red-black tree ordered by (size, address).
+#define TLSF_SL_LOG 5
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG)
+#define TLSF_ALIGN_LOG 3
+#define TLSF_FL_SHIFT (TLSF_SL_LOG + TLSF_ALIGN_LOG)
+#define TLSF_SMALL_SIZE (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT (64 - TLSF_FL_SHIFT + 1)
+#define FREE_TREE_MAX_DEPTH 128
+
+// Build with -DUSE_QUICK_LISTS=1 to park freed heap blocks of up to
+// QUICK_MAX_SIZE bytes on a LIFO list of their exact size instead of
+// merging them, so freeing and allocating the same size again doesn't merge
+// and split every time. Parked blocks are merged when a request finds no
+// free block, or when they fragment the heap: a parked block only serves
+// its own size, so once more bytes are parked than the free index holds,
+// and at least QUICK_MIN_BYTES, requests of other sizes are likely to grow
+// the heap while that memory sits idle. It is off by default since the
+// tests expect a freed block to merge right away.
+#ifndef USE_QUICK_LISTS
+#define USE_QUICK_LISTS 0
+#endif
+#define QUICK_MAX_SIZE 256
+#define QUICK_NUM_LISTS (QUICK_MAX_SIZE / 8)
+#define QUICK_MIN_BYTES ((size_t)64 * 1024)
+
+// Build with -DUSE_SLAB_ALLOCATOR=1 to serve requests up to SLAB_MAX_SIZE
+// from header-less slabs. It is off by default since those objects don't
+// follow the one-header-per-block layout that the statistics describe.
+#ifndef USE_SLAB_ALLOCATOR
+#define USE_SLAB_ALLOCATOR 0
+#endif
+#define SLAB_MAX_SIZE 64
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / 8)
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_HEADER_SIZE 128
+#define SLAB_MAP_WORDS ((SLAB_PAGE_SIZE / 8 + 63) / 64)
+#define SLAB_REGION_SIZE ((size_t)256 * 1024 * 1024)
+
+// Build with -DUSE_BUDDY_ALLOCATOR=1 to replace the first-fit sbrk heap with
+// a binary buddy system of orders 0..BUDDY_MAX_ORDER. Requests that don't
+// fit a max order block go to mmap.
+#ifndef USE_BUDDY_ALLOCATOR
+#define USE_BUDDY_ALLOCATOR 0
+#endif
+#define BUDDY_MIN_BLOCK 128UL
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_MAX_BLOCK (BUDDY_MIN_BLOCK << BUDDY_MAX_ORDER)
+#define BUDDY_MAX_PAYLOAD (BUDDY_MAX_BLOCK - sizeof(MallocMetadata))
+#define BUDDY_GROW_BLOCKS 32
+
+// Build with -DUSE_THREAD_CACHE=1 to keep up to TCACHE_BIN_COUNT freed
+// blocks of every size up to TCACHE_MAX_SIZE in a per-thread cache. Cached
+// blocks are not coalesced, so it is off by default.
+#ifndef USE_THREAD_CACHE
+#define USE_THREAD_CACHE 0
+#endif
+#define TCACHE_MAX_SIZE 1024
+#define TCACHE_NUM_BINS (TCACHE_MAX_SIZE / 8)
+#define TCACHE_BIN_COUNT 32
+#define TCACHE_BATCH 16
+#define CENTRAL_MAX_BLOCKS 1024
+
+// Build with -DUSE_CPU_CACHE=1 to put the same bins in front of the heap
+// per CPU instead of per thread, which bounds cached memory by the number
+// of cores rather than the number of threads. They are updated with
+// restartable sequences on x86-64 when glibc registered an rseq area.
+#ifndef USE_CPU_CACHE
+#define USE_CPU_CACHE 0
+#endif
+#define CPU_CACHE_MAX 64
+
+// Build with -DUSE_LARGE_CACHE=1 to keep released mmapped blocks mapped for
+// reuse, up to LARGE_CACHE_MAX_BYTES in total. A mapping that has sat in the
+// cache through LARGE_CACHE_MAX_AGE large allocations and releases is
+// unmapped. It is off by default since cached mappings stay resident.
+#ifndef USE_LARGE_CACHE
+#define USE_LARGE_CACHE 0
+#endif
+#define LARGE_CACHE_MAX_BYTES ((size_t)64 * 1024 * 1024)
+#define LARGE_CACHE_MAX_AGE 256
+#define LARGE_CACHE_BUCKETS 16
+#define LARGE_CACHE_SLOTS 8
+
+// Build with -DUSE_LARGE_HEADROOM=1 to reserve LARGE_HEADROOM_PERCENT of
+// every new mmapped block as inaccessible address space behind it, so the
+// block can later grow in place. The headroom is never committed.
+#ifndef USE_LARGE_HEADROOM
+#define USE_LARGE_HEADROOM 0
+#endif
+#ifndef LARGE_HEADROOM_PERCENT
+#define LARGE_HEADROOM_PERCENT 100
+#endif
+
+// Build with -DUSE_SPAN_ALLOCATOR=1 to carve mmapped blocks of up to
+// SPAN_MAX_PAGES pages out of shared SPAN_CHUNK_SIZE mappings instead of
+// giving each its own. Only hugetlb blocks still get a mapping each, and so
+// do blocks of HUGE_PAGE_SIZE or more with USE_THP_FALLBACK, which are
+// aligned for THP instead: spans then serve LARGE_BLOCK up to 2MB only.
+#ifndef USE_SPAN_ALLOCATOR
+#define USE_SPAN_ALLOCATOR 0
+#endif
+#define SPAN_PAGE_SIZE 4096UL
+#define SPAN_CHUNK_SIZE ((size_t)64 * 1024 * 1024)
+#define SPAN_CHUNK_PAGES (SPAN_CHUNK_SIZE / SPAN_PAGE_SIZE)
+#define SPAN_MAX_PAGES 1024
+#define SPAN_MAX_BYTES (SPAN_MAX_PAGES * SPAN_PAGE_SIZE)
+#define SPAN_FREE_BIT 0x80000000u
+#define SPAN_SERVES(length) ((length) <= SPAN_MAX_BYTES && !(USE_THP_FALLBACK && (length) >= HUGE_PAGE_SIZE))
+// A free run is given back to the OS once this many of its pages (1MB) may
+// have been written since, so most releases don't make a system call
+#define SPAN_PURGE_PAGES 256
+
+// Build with -DUSE_HUGE_POOL=1 to serve hugetlb blocks of up to
+// HUGE_POOL_REGION_PAGES huge pages from pooled regions, which keep freed
+// pages for reuse instead of returning them to the kernel.
+#ifndef USE_HUGE_POOL
+#define USE_HUGE_POOL 0
+#endif
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+#define HUGETLB_MAP_FLAGS (MAP_HUGETLB | MAP_PRIVATE | MAP_ANONYMOUS)
+#define HUGE_POOL_REGION_PAGES 16
+#define HUGE_POOL_MAX_REGIONS 32
+
+// Mappings of at least HUGE_PAGE_SIZE that don't get hugetlb pages, either
+// because of their size or because none are reserved, are aligned to
+// HUGE_PAGE_SIZE and marked MADV_HUGEPAGE so THP can back them.
+#ifndef USE_THP_FALLBACK
+#define USE_THP_FALLBACK 1
+#endif
+// After MAP_HUGETLB fails, this many huge requests skip it before it is
+// tried again, in case the pool was only empty for a while.
+#define HUGETLB_RETRY_INTERVAL 64
+
+// Build with -DUSE_THP_HEAP=1 to move the program break in steps that end
+// on a HUGE_PAGE_SIZE boundary and mark them MADV_HUGEPAGE, so THP can
+// back the sbrk heap. Heap segments get MADV_HUGEPAGE as well.
+#ifndef USE_THP_HEAP
+#define USE_THP_HEAP 0
+#endif
+
+// By default the program break moves by exactly what every new block needs,
+// which the tests' verify_size relies on. Build with -DHEAP_STRICT_SBRK=0 to
+// move it in chunks instead, starting at HEAP_GROW_MIN and doubling up to
+// HEAP_GROW_MAX, and carve blocks from the unused top of the heap.
+// _num_unused_top_bytes() then accounts for the difference.
+#ifndef HEAP_STRICT_SBRK
+#define HEAP_STRICT_SBRK 1
+#endif
+#define HEAP_GROW_MIN ((size_t)128 * 1024)
+#define HEAP_GROW_MAX ((size_t)8 * 1024 * 1024)
+
+// Heaps that don't use the program break reserve HEAP_SEGMENT_SIZE bytes of
+// address space at a time and commit it HEAP_COMMIT_STEP bytes at a time.
+// Build with -DUSE_SBRK_HEAP=0 to put the main heap on segments as well.
+#ifndef USE_SBRK_HEAP
+#define USE_SBRK_HEAP 1
+#endif
+#define HEAP_SEGMENT_SIZE ((size_t)1024 * 1024 * 1024)
+#define HEAP_COMMIT_STEP ((size_t)1024 * 1024)
+
+// Threads are spread over ARENA_COUNT independent heaps, 0 means one per
+// CPU. Arena 0 is the main heap, the others always grow on segments.
+#ifndef ARENA_COUNT
+#define ARENA_COUNT 0
+#endif
+#define ARENA_MAX 64
+
+// srealloc moves blocks with copyMemory, which runs the widest vector loop
+// the CPU supports. Disjoint copies of at least the last-level cache size,
+// capped at COPY_NT_THRESHOLD as that cache is shared, bypass the cache with
+// non-temporal stores. Copies below COPY_ENGINE_MIN_SIZE are left to memmove.
+#ifndef USE_COPY_ENGINE
+#define USE_COPY_ENGINE 1
+#endif
+#define COPY_ENGINE_MIN_SIZE 4096
+#define COPY_NT_THRESHOLD ((size_t)8 * 1024 * 1024)
+
+// sfree and srealloc find the engine that owns a pointer in a three level
+// radix tree over the 4KB page numbers of a 48 bit address space.
+#define PAGE_MAP_PAGE_SHIFT 12
+#define PAGE_MAP_LEVEL_BITS 12
+#define PAGE_MAP_NODE_SIZE (1UL << PAGE_MAP_LEVEL_BITS)
+#define PAGE_MAP_ADDRESS_BITS (PAGE_MAP_PAGE_SHIFT + 3 * PAGE_MAP_LEVEL_BITS)
+#define PAGE_NONE 0
+#define PAGE_HEAP 1
+#define PAGE_MMAP 2
+#define PAGE_SLAB 3
+#define PAGE_BUDDY 4
+
+// All the statistics, taken at once, like mallinfo2.
+struct smallinfo{
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t meta_data_bytes;
+    size_t size_meta_data;
+};
+
 #define ALIGN_SIZE(size) do { \
     size = (size % 8) ? (size & (size_t)(-8)) + 8 : size;\
 } while( 0 )  \
@@ -42,566 +263,3168 @@ void  sfree(void* p);
 void* srealloc(void* oldp, size_t size);
 /***************************************************/
 
+// Lengths of mappings are kept in these units in the header.
+#define MAP_LENGTH_UNIT 4096UL
+
+// The header is two words: the size, the flags, a short cookie and the
+// released byte packed in one, and the size of the previous block in the
+// other. Free blocks keep
+// their free list or free tree links in the first two words of the payload,
+// which is why heap blocks are never smaller than FREE_LINKS_SIZE: requests
+// under 16 bytes get a 16 byte payload, 32 bytes with the header.
 class MallocMetadata{
 public:
-    int cookie;
-    size_t size;
-    bool is_free;
-    MallocMetadata* next;
-    MallocMetadata* prev;
+    // Blocks are bounded by MAX_SIZE, or by the heap when merged
+    uint64_t size : 41;
+    uint64_t is_free : 1;
+    uint64_t is_last : 1;
+    uint64_t is_mmap : 1;
+    uint64_t is_huge : 1;
+    // Carved out of a shared mapping: a span, or a hugetlb pool run if is_huge
+    uint64_t is_span : 1;
+    // The payload is known to be all zero, as it came from the OS and
+    // hasn't been handed out since
+    uint64_t is_zero : 1;
+    // Parked on a quick list, free but not in the free index
+    uint64_t is_quick : 1;
+    uint64_t cookie : 8;
+    // Nonzero while the block is the allocator's: free, parked, or freed by
+    // another thread and waiting on its arena's remote free list. It is a
+    // byte of its own rather than a bit, so that thread can claim the block
+    // while the owner rewrites the flags, and is only accessed atomically.
+    uint8_t released;
+    // For mmapped blocks there is no previous block, so this holds the
+    // length of the mapping in its low half, and of the mapping plus its
+    // PROT_NONE headroom in its high half, in MAP_LENGTH_UNITs.
+    size_t prev_size;
 
     MallocMetadata() = default;
     MallocMetadata(size_t size) : size(size), is_free(false) {};
-};
- 
-class AllocedBlocksList{
-    public:
-        MallocMetadata* head;
-        MallocMetadata* head_large;
-        MallocMetadata* wilderness_block;
-        int cookie_code;
 
-        AllocedBlocksList();
-        ~AllocedBlocksList() = default;
-    
-        void* insertBlock(size_t size, MallocMetadata* block = nullptr);
-        void* allocateFreeBlock(size_t size);
-        void releaseBlock(void* ptr);
-        void releaseRegularBlock(void* ptr);
-        void* SplitAndInsert(size_t new_size, MallocMetadata* old_block);
-        void RemoveBlock(MallocMetadata* block);
-        MallocMetadata* GetNextIfFree(MallocMetadata* ptr);
-        MallocMetadata* GetPrevIfFree(MallocMetadata* ptr);
-        void UnionAndInsert(MallocMetadata* curr, MallocMetadata* next, MallocMetadata* prev, bool isfree = 1);
-        void* insertLargeBlock(size_t size, int is_scalloc = 0);
-        void releaseLargeBlock(void* ptr);
-        void VerifyCookieCode(MallocMetadata* block);
-        void* ReallocateRegularBlock(MallocMetadata* block, size_t size);
-        void* ReallocateLargeBlock(MallocMetadata* block, size_t size);
+    MallocMetadata*& next_free() { return ((MallocMetadata**)(this + 1))[0]; }
+    MallocMetadata*& prev_free() { return ((MallocMetadata**)(this + 1))[1]; }
+
+    bool isReleased() { return __atomic_load_n(&released, __ATOMIC_RELAXED); }
+    void setReleased(bool value) { __atomic_store_n(&released, value, __ATOMIC_RELAXED); }
+    // Sets released and returns whether it was clear
+    bool markReleased() { return !__atomic_exchange_n(&released, 1, __ATOMIC_ACQ_REL); }
+
+    // The size, flags and cookie in one load, for a thread that doesn't own
+    // the block while its owner may be rewriting them.
+    MallocMetadata loadFlags() {
+        uint64_t word = __atomic_load_n((uint64_t*)this, __ATOMIC_RELAXED);
+        MallocMetadata flags{};
+        std::memcpy(&flags, &word, sizeof(word));
+        return flags;
+    }
 
-        size_t num_free_blocks();
-        size_t num_free_bytes();
-        size_t num_allocated_blocks();
-        size_t num_allocated_bytes();
-        size_t num_meta_data_bytes();
-        size_t size_meta_data();
+    size_t mapLength() { return (prev_size & 0xffffffff) * MAP_LENGTH_UNIT; }
+    size_t reservedLength() { return (prev_size >> 32) * MAP_LENGTH_UNIT; }
+    void setMapLengths(size_t length, size_t reserved_length) {
+        prev_size = (length / MAP_LENGTH_UNIT) | (reserved_length / MAP_LENGTH_UNIT) << 32;
+    }
+};
 
-        MallocMetadata* data_to_meta(void* p);
-        void* meta_to_data(MallocMetadata* p);
+static_assert(sizeof(MallocMetadata) == 16, "the header should be two words");
+static_assert(ARENA_MAX <= 256, "page map owners have 8 bits");
+
+// Smallest payload of a heap block, room for the links of a free block
+#define FREE_LINKS_SIZE (2 * sizeof(MallocMetadata*))
+ 
+class LargeBlockCache{
+public:
+    struct Entry{
+        void* address;
+        size_t length;
+        unsigned long last_used;
+    };
+
+    Entry entries[LARGE_CACHE_BUCKETS][LARGE_CACHE_SLOTS];
+    int num_entries[LARGE_CACHE_BUCKETS];
+    size_t cached_bytes;
+    unsigned long clock;
+    size_t hits;
+    size_t misses;
+    pthread_mutex_t lock;
+
+    LargeBlockCache() : entries(), num_entries(), cached_bytes(0), clock(0), hits(0), misses(0), lock(PTHREAD_MUTEX_INITIALIZER) {}
+
+    static int Bucket(size_t length);
+    void* Take(size_t length, size_t* mapped_length);
+    bool Put(void* address, size_t length);
+    void Evict(int bucket, int slot);
+    void EvictOldest();
+    void EvictExpired();
 };
 
-AllocedBlocksList::AllocedBlocksList() : head(nullptr), head_large(nullptr), wilderness_block(nullptr), cookie_code(rand()){}
+LargeBlockCache largeBlockCache;
 
-MallocMetadata* AllocedBlocksList::data_to_meta(void* p){
-    MallocMetadata* meta_data_ptr = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
-    VerifyCookieCode(meta_data_ptr);
-    return meta_data_ptr;
+// One bucket per power of two of the length, starting at 128KB.
+int LargeBlockCache::Bucket(size_t length){
+    int bucket = 63 - __builtin_clzl(length) - 17;
+    if(bucket < 0){
+        return 0;
+    }
+    return bucket < LARGE_CACHE_BUCKETS ? bucket : LARGE_CACHE_BUCKETS - 1;
 }
 
-void* AllocedBlocksList::meta_to_data(MallocMetadata* p){
-    VerifyCookieCode(p);
-    return (char*)p + sizeof(MallocMetadata);
+// Returns the smallest cached mapping of at least length bytes that doesn't
+// waste more than a quarter of it, or NULL.
+void* LargeBlockCache::Take(size_t length, size_t* mapped_length){
+    pthread_mutex_lock(&lock);
+    EvictExpired();
+    int best_bucket = -1, best_slot = -1;
+    for(int bucket = Bucket(length); bucket <= Bucket(length + length / 4); bucket++){
+        for(int slot = 0; slot < num_entries[bucket]; slot++){
+            size_t cached_length = entries[bucket][slot].length;
+            if(cached_length >= length && cached_length <= length + length / 4 &&
+               (best_bucket < 0 || cached_length < entries[best_bucket][best_slot].length)){
+                best_bucket = bucket;
+                best_slot = slot;
+            }
+        }
+    }
+
+    void* address = NULL;
+    if(best_bucket < 0){
+        misses++;
+    }
+    else{
+        hits++;
+        address = entries[best_bucket][best_slot].address;
+        *mapped_length = entries[best_bucket][best_slot].length;
+        cached_bytes -= *mapped_length;
+        entries[best_bucket][best_slot] = entries[best_bucket][--num_entries[best_bucket]];
+    }
+    pthread_mutex_unlock(&lock);
+    return address;
 }
 
-void AllocedBlocksList::VerifyCookieCode(MallocMetadata* block){
-    if(block == NULL){
-        return;
+// Returns false if the mapping should be unmapped by the caller instead.
+bool LargeBlockCache::Put(void* address, size_t length){
+    if(length > LARGE_CACHE_MAX_BYTES / 4){
+        return false;
     }
-    if(block->cookie != cookie_code){
-        exit(DEADBEEF);
+    pthread_mutex_lock(&lock);
+    EvictExpired();
+    while(cached_bytes + length > LARGE_CACHE_MAX_BYTES){
+        EvictOldest();
+    }
+
+    int bucket = Bucket(length);
+    if(num_entries[bucket] == LARGE_CACHE_SLOTS){
+        int oldest = 0;
+        for(int slot = 1; slot < LARGE_CACHE_SLOTS; slot++){
+            if(entries[bucket][slot].last_used < entries[bucket][oldest].last_used){
+                oldest = slot;
+            }
+        }
+        Evict(bucket, oldest);
     }
+    entries[bucket][num_entries[bucket]++] = { address, length, clock };
+    cached_bytes += length;
+    pthread_mutex_unlock(&lock);
+    return true;
 }
 
-void* AllocedBlocksList::insertBlock(size_t size, MallocMetadata* new_block)
-{   
-    if (new_block == nullptr) {
-        if (wilderness_block != nullptr && wilderness_block->is_free) {
-            RemoveBlock(wilderness_block);
-            sbrk(size - wilderness_block->size);
-            wilderness_block->size += size - wilderness_block->size;
-            new_block = wilderness_block;
-        } else {
-            new_block = (MallocMetadata*)sbrk(size_meta_data() + size);
-            if(new_block == (void*)-1) {
-                return NULL;
+void LargeBlockCache::Evict(int bucket, int slot){
+    munmap(entries[bucket][slot].address, entries[bucket][slot].length);
+    cached_bytes -= entries[bucket][slot].length;
+    entries[bucket][slot] = entries[bucket][--num_entries[bucket]];
+}
+
+// Ticks the clock, which counts both takes and puts so that mappings also
+// age while the process only allocates.
+void LargeBlockCache::EvictExpired(){
+    clock++;
+    for(int bucket = 0; bucket < LARGE_CACHE_BUCKETS; bucket++){
+        for(int slot = num_entries[bucket] - 1; slot >= 0; slot--){
+            if(clock - entries[bucket][slot].last_used > LARGE_CACHE_MAX_AGE){
+                Evict(bucket, slot);
             }
-            wilderness_block = new_block;
         }
     }
-    VerifyCookieCode(head);
+}
 
-    new_block->cookie = this->cookie_code;
-    new_block->is_free = 0;
-    new_block->size = size;
-    new_block->next = NULL;
-    new_block->prev = NULL;
+void LargeBlockCache::EvictOldest(){
+    int oldest_bucket = -1, oldest_slot = -1;
+    for(int bucket = 0; bucket < LARGE_CACHE_BUCKETS; bucket++){
+        for(int slot = 0; slot < num_entries[bucket]; slot++){
+            if(oldest_bucket < 0 || entries[bucket][slot].last_used < entries[oldest_bucket][oldest_slot].last_used){
+                oldest_bucket = bucket;
+                oldest_slot = slot;
+            }
+        }
+    }
+    Evict(oldest_bucket, oldest_slot);
+}
 
-    if (head == NULL) {
-        head = new_block;
-        return meta_to_data(head);
+// Huge requests left to send straight to the THP fallback since
+// MAP_HUGETLB last failed, instead of failing the same syscall again.
+std::atomic<int> hugetlb_backoff(0);
+std::atomic<size_t> num_hugetlb_blocks(0);
+std::atomic<size_t> num_thp_blocks(0);
+std::atomic<size_t> num_base_page_blocks(0);
+
+// mmap with the start aligned to alignment, by over-mapping and trimming.
+void* mapAligned(size_t length, size_t alignment, int prot, int flags){
+    if(alignment <= (size_t)getpagesize()){
+        return mmap(NULL, length, prot, flags, -1, 0);
     }
-    
-    if (head->size > new_block->size) {
-        new_block->next = head;
-        head->prev = new_block;
-        head = new_block;
+    char* mapping = (char*)mmap(NULL, length + alignment, prot, flags, -1, 0);
+    if(mapping == (void*)-1){
+        return mapping;
+    }
+    char* start = (char*)(((uintptr_t)mapping + alignment - 1) & ~(alignment - 1));
+    if(start != mapping){
+        munmap(mapping, start - mapping);
+    }
+    munmap(start + length, mapping + alignment - start);
+    return start;
+}
+
+////////////////////////////////////////////////////////
+/*
+                    Page Map                 
+                                                      */
+////////////////////////////////////////////////////////
+
+// An entry holds the tier in its low byte and the owner in its high byte:
+// the arena for heap and mmap pages, the size class for slab pages. Heap,
+// slab and buddy pages are entered as the engines grow, an mmapped block
+// only for its first page, which is where its pointer is.
+class PageMapLeaf{
+public:
+    std::atomic<uint16_t> entries[PAGE_MAP_NODE_SIZE];
+};
+
+class PageMapNode{
+public:
+    std::atomic<PageMapLeaf*> leaves[PAGE_MAP_NODE_SIZE];
+};
 
-        return meta_to_data(head);
+// Nodes are mapped on first use and never freed, so lookups need no lock.
+class PageMap{
+public:
+    std::atomic<PageMapNode*> nodes[PAGE_MAP_NODE_SIZE];
+
+    uint16_t lookup(const void* p);
+    bool set(const void* start, size_t length, int tier, int owner = 0);
+    void clear(const void* start, size_t length);
+
+private:
+    template <typename T> T* Child(std::atomic<T*>* slot, bool create);
+    std::atomic<uint16_t>* Entry(uintptr_t page, bool create);
+};
+
+PageMap pageMap;
+
+inline int pageTier(uint16_t entry){
+    return entry & 0xff;
+}
+
+inline int pageOwner(uint16_t entry){
+    return entry >> 8;
+}
+
+template <typename T> T* PageMap::Child(std::atomic<T*>* slot, bool create){
+    T* child = slot->load(std::memory_order_acquire);
+    if(child != nullptr || !create){
+        return child;
+    }
+    void* memory = mmap(NULL, sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == (void*)-1){
+        return nullptr;
+    }
+    // Zeroed by the kernel, which is an empty node
+    child = new (memory) T;
+    T* expected = nullptr;
+    if(!slot->compare_exchange_strong(expected, child, std::memory_order_acq_rel)){
+        munmap(memory, sizeof(T));
+        return expected;
     }
-    if (head->size == new_block->size && head > new_block) {
-        new_block->next = head;
-        head->prev = new_block;
-        head = new_block;
+    return child;
+}
 
-        return meta_to_data(head);
+std::atomic<uint16_t>* PageMap::Entry(uintptr_t page, bool create){
+    if(page >> (2 * PAGE_MAP_LEVEL_BITS) >= PAGE_MAP_NODE_SIZE){
+        return nullptr;
     }
- 
-    MallocMetadata* temp = head;
-    while (temp->next != NULL) {
-        VerifyCookieCode(temp->next);
-        if (temp->next->size > new_block->size) {
-            temp->next->prev = new_block;
-            new_block->next = temp->next;
-            new_block->prev = temp;
-            temp->next = new_block;
-            break;
-        }
-        if (temp->next->size == new_block->size && temp->next > new_block) {
-            temp->next->prev = new_block;
-            new_block->next = temp->next;
-            new_block->prev = temp;
-            temp->next = new_block;
-            break;
+    PageMapNode* node = Child(&nodes[page >> (2 * PAGE_MAP_LEVEL_BITS)], create);
+    if(node == nullptr){
+        return nullptr;
+    }
+    PageMapLeaf* leaf = Child(&node->leaves[(page >> PAGE_MAP_LEVEL_BITS) & (PAGE_MAP_NODE_SIZE - 1)], create);
+    if(leaf == nullptr){
+        return nullptr;
+    }
+    return &leaf->entries[page & (PAGE_MAP_NODE_SIZE - 1)];
+}
+
+// PAGE_NONE for memory that no engine handed out.
+uint16_t PageMap::lookup(const void* p){
+    std::atomic<uint16_t>* entry = Entry((uintptr_t)p >> PAGE_MAP_PAGE_SHIFT, false);
+    return entry == nullptr ? PAGE_NONE : entry->load(std::memory_order_relaxed);
+}
+
+// Fails if a node can't be mapped, leaving the pages it did enter.
+bool PageMap::set(const void* start, size_t length, int tier, int owner){
+    uintptr_t first = (uintptr_t)start >> PAGE_MAP_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t)start + length - 1) >> PAGE_MAP_PAGE_SHIFT;
+    for(uintptr_t page = first; page <= last; page++){
+        std::atomic<uint16_t>* entry = Entry(page, true);
+        if(entry == nullptr){
+            return false;
         }
-        temp = temp->next;
-        VerifyCookieCode(temp->next);
+        entry->store(tier | owner << 8, std::memory_order_relaxed);
     }
-    
-    if (temp->next == NULL) {
-        temp->next = new_block;
-        new_block->prev = temp;
+    return true;
+}
+
+void PageMap::clear(const void* start, size_t length){
+    uintptr_t first = (uintptr_t)start >> PAGE_MAP_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t)start + length - 1) >> PAGE_MAP_PAGE_SHIFT;
+    for(uintptr_t page = first; page <= last; page++){
+        std::atomic<uint16_t>* entry = Entry(page, false);
+        if(entry != nullptr){
+            entry->store(PAGE_NONE, std::memory_order_relaxed);
+        }
     }
-    
-    return meta_to_data(new_block);
 }
 
-void* AllocedBlocksList::allocateFreeBlock(size_t size){
-    MallocMetadata* temp = this->head;
+////////////////////////////////////////////////////////
+/*
+                    Copy Engine                 
+                                                      */
+////////////////////////////////////////////////////////
 
-    if (temp == NULL) {
-        return NULL;
+#if defined(__x86_64__)
+// Every loop copies n bytes forwards, n a multiple of 256 and dst 64-byte
+// aligned. Each group of vectors is loaded before it is stored, so a
+// destination below an overlapping source is safe.
+typedef void (*CopyLoop)(char* dst, const char* src, size_t n, bool non_temporal);
+
+static void copyLoopSse2(char* dst, const char* src, size_t n, bool non_temporal){
+    for(size_t i = 0; i < n; i += 64){
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+        if(non_temporal){
+            _mm_stream_si128((__m128i*)(dst + i), a);
+            _mm_stream_si128((__m128i*)(dst + i + 16), b);
+            _mm_stream_si128((__m128i*)(dst + i + 32), c);
+            _mm_stream_si128((__m128i*)(dst + i + 48), d);
+        }
+        else{
+            _mm_store_si128((__m128i*)(dst + i), a);
+            _mm_store_si128((__m128i*)(dst + i + 16), b);
+            _mm_store_si128((__m128i*)(dst + i + 32), c);
+            _mm_store_si128((__m128i*)(dst + i + 48), d);
+        }
     }
- 
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        if(temp->is_free == 1 && temp->size >= size){
-            temp->is_free = 0;
-            return meta_to_data(temp);
+}
+
+__attribute__((target("avx2")))
+static void copyLoopAvx2(char* dst, const char* src, size_t n, bool non_temporal){
+    for(size_t i = 0; i < n; i += 128){
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + i + 96));
+        if(non_temporal){
+            _mm256_stream_si256((__m256i*)(dst + i), a);
+            _mm256_stream_si256((__m256i*)(dst + i + 32), b);
+            _mm256_stream_si256((__m256i*)(dst + i + 64), c);
+            _mm256_stream_si256((__m256i*)(dst + i + 96), d);
+        }
+        else{
+            _mm256_store_si256((__m256i*)(dst + i), a);
+            _mm256_store_si256((__m256i*)(dst + i + 32), b);
+            _mm256_store_si256((__m256i*)(dst + i + 64), c);
+            _mm256_store_si256((__m256i*)(dst + i + 96), d);
         }
-        temp = temp->next;
     }
-    return NULL;
 }
 
-MallocMetadata* AllocedBlocksList::GetNextIfFree(MallocMetadata* ptr) {
-    // Find ptr + size + metadata_size
-    VerifyCookieCode(ptr);
-    MallocMetadata* curr = this->head;
-    while (curr != NULL) {
-        VerifyCookieCode(curr);
-        if((char*)curr == (char*)ptr + ptr->size + size_meta_data()) {
-            return curr->is_free ? curr : nullptr;
+__attribute__((target("avx512f")))
+static void copyLoopAvx512(char* dst, const char* src, size_t n, bool non_temporal){
+    for(size_t i = 0; i < n; i += 256){
+        __m512i a = _mm512_loadu_si512((const void*)(src + i));
+        __m512i b = _mm512_loadu_si512((const void*)(src + i + 64));
+        __m512i c = _mm512_loadu_si512((const void*)(src + i + 128));
+        __m512i d = _mm512_loadu_si512((const void*)(src + i + 192));
+        if(non_temporal){
+            _mm512_stream_si512((__m512i*)(dst + i), a);
+            _mm512_stream_si512((__m512i*)(dst + i + 64), b);
+            _mm512_stream_si512((__m512i*)(dst + i + 128), c);
+            _mm512_stream_si512((__m512i*)(dst + i + 192), d);
+        }
+        else{
+            _mm512_store_si512((void*)(dst + i), a);
+            _mm512_store_si512((void*)(dst + i + 64), b);
+            _mm512_store_si512((void*)(dst + i + 128), c);
+            _mm512_store_si512((void*)(dst + i + 192), d);
         }
-        curr = curr->next;
     }
-    return nullptr;
 }
 
-MallocMetadata* AllocedBlocksList::GetPrevIfFree(MallocMetadata* ptr) {
-    // Find curr + curr_size + metadata_size == ptr
-    VerifyCookieCode(ptr);
-    MallocMetadata* curr = this->head;
-    while (curr != NULL) {
-        VerifyCookieCode(curr);
-        if((char*)curr + curr->size + size_meta_data() == (char*)ptr) {
-            return curr->is_free ? curr : nullptr;
+std::atomic<CopyLoop> copy_loop(nullptr);
+std::atomic<size_t> copy_nt_threshold(COPY_NT_THRESHOLD);
+
+// Picks the loop. Threads racing here store the same values, and the
+// threshold is stored before the release that publishes the loop.
+static CopyLoop resolveCopyLoop(){
+    long cache_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if(cache_size > 0 && (size_t)cache_size < COPY_NT_THRESHOLD){
+        copy_nt_threshold.store(cache_size, std::memory_order_relaxed);
+    }
+    __builtin_cpu_init();
+    CopyLoop loop = copyLoopSse2;
+    if(__builtin_cpu_supports("avx512f")){
+        loop = copyLoopAvx512;
+    }
+    else if(__builtin_cpu_supports("avx2")){
+        loop = copyLoopAvx2;
+    }
+    copy_loop.store(loop, std::memory_order_release);
+    return loop;
+}
+#endif
+
+// memmove for block moves. A destination above an overlapping source has to
+// be copied backwards, srealloc never moves a block up so memmove does it.
+void copyMemory(void* dst, const void* src, size_t n){
+    char* d = (char*)dst;
+    const char* s = (const char*)src;
+    if(!USE_COPY_ENGINE || n < COPY_ENGINE_MIN_SIZE || (d > s && d < s + n)){
+        memmove(dst, src, n);
+        return;
+    }
+#if defined(__x86_64__)
+    CopyLoop loop = copy_loop.load(std::memory_order_acquire);
+    if(loop == nullptr){
+        loop = resolveCopyLoop();
+    }
+    size_t head = (64 - ((uintptr_t)d & 63)) & 63;
+    size_t body = (n - head) & ~(size_t)255;
+    // Streaming into an overlapping source would evict the lines about to
+    // be read.
+    bool non_temporal = n >= copy_nt_threshold.load(std::memory_order_relaxed) && (d + n <= s || s + n <= d);
+    memmove(d, s, head);
+    loop(d + head, s + head, body, non_temporal);
+    if(non_temporal){
+        _mm_sfence();
+    }
+    memmove(d + head + body, s + head + body, n - head - body);
+#else
+    memmove(dst, src, n);
+#endif
+}
+
+////////////////////////////////////////////////////////
+/*
+                    Span Allocator                 
+                                                      */
+////////////////////////////////////////////////////////
+
+// Page map at the start of every chunk. The first and the last page of each
+// run hold its length in pages, with SPAN_FREE_BIT set if it is free, which
+// is all that is needed to find and merge with the runs on either side.
+class SpanChunk{
+public:
+    uint32_t run_pages[SPAN_CHUNK_PAGES];
+};
+
+#define SPAN_FIRST_PAGE ((sizeof(SpanChunk) + SPAN_PAGE_SIZE - 1) / SPAN_PAGE_SIZE)
+
+// Free runs are linked through their first page, which also counts how
+// many of the run's pages may be dirty. Carving a run doesn't say which of
+// them were taken, so the count is only ever an upper bound.
+struct SpanFreeRun{
+    SpanFreeRun* next;
+    SpanFreeRun* prev;
+    size_t dirty_pages;
+};
+
+class SpanAllocator{
+public:
+    // One list per run length, runs of SPAN_MAX_PAGES or more share the last
+    SpanFreeRun* free_runs[SPAN_MAX_PAGES + 1];
+    uint64_t bitmap[SPAN_MAX_PAGES / 64 + 1];
+    size_t num_chunks;
+    pthread_mutex_t lock;
+
+    SpanAllocator() : free_runs(), bitmap(), num_chunks(0), lock(PTHREAD_MUTEX_INITIALIZER) {}
+
+    static SpanChunk* ChunkOf(void* p) { return (SpanChunk*)((uintptr_t)p & ~(SPAN_CHUNK_SIZE - 1)); }
+    static size_t PageIndex(SpanChunk* chunk, void* p) { return ((char*)p - (char*)chunk) / SPAN_PAGE_SIZE; }
+    static char* PageAddress(SpanChunk* chunk, size_t page) { return (char*)chunk + page * SPAN_PAGE_SIZE; }
+    static size_t Bin(size_t pages) { return pages < SPAN_MAX_PAGES ? pages : SPAN_MAX_PAGES; }
+
+    void SetRun(SpanChunk* chunk, size_t first, size_t pages, bool is_free);
+    void InsertRun(SpanChunk* chunk, size_t first, size_t pages, size_t dirty_pages);
+    void RemoveRun(SpanChunk* chunk, size_t first, size_t pages);
+    int FindBin(size_t pages);
+    bool AddChunk();
+    void ReleaseRun(SpanChunk* chunk, size_t first, size_t pages);
+
+    void* allocateSpan(size_t length);
+    void releaseSpan(void* p);
+    bool resizeSpan(void* p, size_t old_length, size_t length);
+};
+
+SpanAllocator spanAllocator;
+
+void SpanAllocator::SetRun(SpanChunk* chunk, size_t first, size_t pages, bool is_free){
+    uint32_t value = pages | (is_free ? SPAN_FREE_BIT : 0);
+    chunk->run_pages[first] = value;
+    chunk->run_pages[first + pages - 1] = value;
+}
+
+void SpanAllocator::InsertRun(SpanChunk* chunk, size_t first, size_t pages, size_t dirty_pages){
+    SetRun(chunk, first, pages, true);
+    size_t bin = Bin(pages);
+    SpanFreeRun* run = (SpanFreeRun*)PageAddress(chunk, first);
+    run->dirty_pages = dirty_pages < pages ? dirty_pages : pages;
+    run->prev = nullptr;
+    run->next = free_runs[bin];
+    if(run->next != nullptr){
+        run->next->prev = run;
+    }
+    free_runs[bin] = run;
+    bitmap[bin / 64] |= 1UL << (bin % 64);
+}
+
+void SpanAllocator::RemoveRun(SpanChunk* chunk, size_t first, size_t pages){
+    size_t bin = Bin(pages);
+    SpanFreeRun* run = (SpanFreeRun*)PageAddress(chunk, first);
+    if(run->prev != nullptr){
+        run->prev->next = run->next;
+    }
+    else{
+        free_runs[bin] = run->next;
+    }
+    if(run->next != nullptr){
+        run->next->prev = run->prev;
+    }
+    if(free_runs[bin] == nullptr){
+        bitmap[bin / 64] &= ~(1UL << (bin % 64));
+    }
+}
+
+// Returns the smallest non-empty bin that fits pages, or -1.
+int SpanAllocator::FindBin(size_t pages){
+    size_t bin = Bin(pages);
+    while(bin <= SPAN_MAX_PAGES){
+        uint64_t bits = bitmap[bin / 64] & (~0UL << (bin % 64));
+        if(bits != 0){
+            return (bin / 64) * 64 + __builtin_ctzl(bits);
         }
-        curr = curr->next;
+        bin = (bin / 64 + 1) * 64;
     }
-    return nullptr;
+    return -1;
 }
 
-void AllocedBlocksList::UnionAndInsert(MallocMetadata* curr, MallocMetadata* next, MallocMetadata* prev, bool isfree) {
-    int situation = 0;
-    RemoveBlock(curr);
-    if(next != NULL){
-        RemoveBlock(next);
-        situation+= 1;
+// Chunks are aligned to their size so a pointer finds its page map.
+bool SpanAllocator::AddChunk(){
+    char* start = (char*)mapAligned(SPAN_CHUNK_SIZE, SPAN_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    if(start == (void*)-1){
+        return false;
     }
-    if(prev != NULL){
-        RemoveBlock(prev);
-        situation+= 2;
+
+    num_chunks++;
+    InsertRun((SpanChunk*)start, SPAN_FIRST_PAGE, SPAN_CHUNK_PAGES - SPAN_FIRST_PAGE, /*dirty_pages=*/0);
+    return true;
+}
+
+void* SpanAllocator::allocateSpan(size_t length){
+    size_t pages = length / SPAN_PAGE_SIZE;
+    pthread_mutex_lock(&lock);
+    int bin = FindBin(pages);
+    if(bin < 0 && AddChunk()){
+        bin = FindBin(pages);
+    }
+    if(bin < 0){
+        pthread_mutex_unlock(&lock);
+        return NULL;
     }
 
-    switch(situation){
-        case 1: // Union curr and next
-            insertBlock(curr->size + next->size + size_meta_data(), curr);
-            curr->is_free = isfree;
-            if (next == wilderness_block) {
-                wilderness_block = curr;
-            }
-            break;
-        case 2: // Union curr and prev
-            insertBlock(curr->size + prev->size + size_meta_data(), prev);
-            prev->is_free = isfree;
-            if (curr == wilderness_block) {
-                wilderness_block = prev;
-            }
-            break;
-        case 3: // Union curr, next and prev
-            insertBlock(prev->size + curr->size + next->size + 2 * size_meta_data(), prev);
-            prev->is_free = isfree;
-            if (next == wilderness_block) {
-                wilderness_block = prev;
+    SpanFreeRun* run = free_runs[bin];
+    SpanChunk* chunk = ChunkOf(run);
+    size_t first = PageIndex(chunk, run);
+    size_t run_pages = chunk->run_pages[first] & ~SPAN_FREE_BIT;
+    RemoveRun(chunk, first, run_pages);
+    if(run_pages > pages){
+        InsertRun(chunk, first + pages, run_pages - pages, run->dirty_pages);
+    }
+    SetRun(chunk, first, pages, false);
+    pthread_mutex_unlock(&lock);
+    return run;
+}
+
+// Merges the run with its free neighbours. A chunk that becomes entirely
+// free is unmapped, unless it is the last one, and a merged run with
+// SPAN_PURGE_PAGES that may be dirty is dropped so they don't stay resident.
+void SpanAllocator::ReleaseRun(SpanChunk* chunk, size_t first, size_t pages){
+    size_t dirty_pages = pages;
+    if(first > SPAN_FIRST_PAGE && (chunk->run_pages[first - 1] & SPAN_FREE_BIT)){
+        size_t left_pages = chunk->run_pages[first - 1] & ~SPAN_FREE_BIT;
+        first -= left_pages;
+        pages += left_pages;
+        dirty_pages += ((SpanFreeRun*)PageAddress(chunk, first))->dirty_pages;
+        RemoveRun(chunk, first, left_pages);
+    }
+    if(first + pages < SPAN_CHUNK_PAGES && (chunk->run_pages[first + pages] & SPAN_FREE_BIT)){
+        size_t right_pages = chunk->run_pages[first + pages] & ~SPAN_FREE_BIT;
+        dirty_pages += ((SpanFreeRun*)PageAddress(chunk, first + pages))->dirty_pages;
+        RemoveRun(chunk, first + pages, right_pages);
+        pages += right_pages;
+    }
+
+    if(pages == SPAN_CHUNK_PAGES - SPAN_FIRST_PAGE && num_chunks > 1){
+        num_chunks--;
+        munmap(chunk, SPAN_CHUNK_SIZE);
+        return;
+    }
+    if(dirty_pages >= SPAN_PURGE_PAGES){
+        madvise(PageAddress(chunk, first), pages * SPAN_PAGE_SIZE, MADV_DONTNEED);
+        dirty_pages = 0;
+    }
+    InsertRun(chunk, first, pages, dirty_pages);
+}
+
+void SpanAllocator::releaseSpan(void* p){
+    pthread_mutex_lock(&lock);
+    SpanChunk* chunk = ChunkOf(p);
+    size_t first = PageIndex(chunk, p);
+    ReleaseRun(chunk, first, chunk->run_pages[first] & ~SPAN_FREE_BIT);
+    pthread_mutex_unlock(&lock);
+}
+
+// Shrinks the span in place, or grows it into a free run right behind it.
+// Returns false if that run is missing or too small.
+bool SpanAllocator::resizeSpan(void* p, size_t old_length, size_t length){
+    size_t old_pages = old_length / SPAN_PAGE_SIZE;
+    size_t pages = length / SPAN_PAGE_SIZE;
+    pthread_mutex_lock(&lock);
+    SpanChunk* chunk = ChunkOf(p);
+    size_t first = PageIndex(chunk, p);
+    bool resized = true;
+
+    if(pages < old_pages){
+        SetRun(chunk, first, pages, false);
+        ReleaseRun(chunk, first + pages, old_pages - pages);
+    }
+    else if(pages > old_pages){
+        size_t next = first + old_pages;
+        size_t next_pages = next < SPAN_CHUNK_PAGES ? chunk->run_pages[next] : 0;
+        if((next_pages & SPAN_FREE_BIT) && old_pages + (next_pages & ~SPAN_FREE_BIT) >= pages){
+            next_pages &= ~SPAN_FREE_BIT;
+            size_t dirty_pages = ((SpanFreeRun*)PageAddress(chunk, next))->dirty_pages;
+            RemoveRun(chunk, next, next_pages);
+            if(old_pages + next_pages > pages){
+                InsertRun(chunk, first + pages, old_pages + next_pages - pages, dirty_pages);
             }
-            break;
+            SetRun(chunk, first, pages, false);
+        }
+        else{
+            resized = false;
+        }
     }
+    pthread_mutex_unlock(&lock);
+    return resized;
+}
 
-    return;
+
+////////////////////////////////////////////////////////
+/*
+                    Huge Page Pool                 
+                                                      */
+////////////////////////////////////////////////////////
+
+// Regions of hugetlb pages, handed out in runs of whole huge pages. Run
+// lengths are kept on the first and last page of each run the same way
+// SpanChunk does, so freed runs merge with their neighbours.
+class HugePageRegion{
+public:
+    char* base;
+    size_t pages;
+    uint32_t run_pages[HUGE_POOL_REGION_PAGES];
+};
+
+class HugePagePool{
+public:
+    HugePageRegion regions[HUGE_POOL_MAX_REGIONS];
+    int num_regions;
+    pthread_mutex_t lock;
+
+    HugePagePool() : regions(), num_regions(0), lock(PTHREAD_MUTEX_INITIALIZER) {}
+
+    void SetRun(HugePageRegion* region, size_t first, size_t pages, bool is_free);
+    void* TakeRun(HugePageRegion* region, size_t pages);
+    HugePageRegion* AddRegion(size_t pages);
+    HugePageRegion* RegionOf(void* p);
+
+    void* allocateRun(size_t length);
+    void releaseRun(void* p);
+};
+
+HugePagePool hugePagePool;
+
+void HugePagePool::SetRun(HugePageRegion* region, size_t first, size_t pages, bool is_free){
+    uint32_t value = pages | (is_free ? SPAN_FREE_BIT : 0);
+    region->run_pages[first] = value;
+    region->run_pages[first + pages - 1] = value;
 }
 
-void AllocedBlocksList::releaseBlock(void* ptr){
-    if(ptr == NULL){
-        return;
+// First fit within the region.
+void* HugePagePool::TakeRun(HugePageRegion* region, size_t pages){
+    size_t first = 0;
+    while(first < region->pages){
+        size_t run_pages = region->run_pages[first] & ~SPAN_FREE_BIT;
+        if((region->run_pages[first] & SPAN_FREE_BIT) && run_pages >= pages){
+            if(run_pages > pages){
+                SetRun(region, first + pages, run_pages - pages, true);
+            }
+            SetRun(region, first, pages, false);
+            return region->base + first * HUGE_PAGE_SIZE;
+        }
+        first += run_pages;
     }
-    MallocMetadata* meta_data_ptr = data_to_meta(ptr);
-    if(meta_data_ptr->size >= LARGE_BLOCK){
-        releaseLargeBlock(ptr);
+    return NULL;
+}
+
+// Maps a full region if there are enough reserved huge pages, otherwise
+// one that just fits the request.
+HugePageRegion* HugePagePool::AddRegion(size_t pages){
+    if(num_regions == HUGE_POOL_MAX_REGIONS){
+        return NULL;
     }
-    else{
-        releaseRegularBlock(ptr);
+    size_t region_pages = HUGE_POOL_REGION_PAGES;
+    char* base = (char*)mmap(NULL, region_pages * HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, HUGETLB_MAP_FLAGS, -1, 0);
+    if(base == (void*)-1 && pages < region_pages){
+        region_pages = pages;
+        base = (char*)mmap(NULL, region_pages * HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, HUGETLB_MAP_FLAGS, -1, 0);
+    }
+    if(base == (void*)-1){
+        return NULL;
+    }
+
+    HugePageRegion* region = &regions[num_regions++];
+    region->base = base;
+    region->pages = region_pages;
+    SetRun(region, 0, region_pages, true);
+    return region;
+}
+
+HugePageRegion* HugePagePool::RegionOf(void* p){
+    for(int i = 0; i < num_regions; i++){
+        if((char*)p >= regions[i].base && (char*)p < regions[i].base + regions[i].pages * HUGE_PAGE_SIZE){
+            return &regions[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns NULL if the request is too big for a region or no huge pages
+// are left.
+void* HugePagePool::allocateRun(size_t length){
+    size_t pages = (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE;
+    if(pages > HUGE_POOL_REGION_PAGES){
+        return NULL;
+    }
+    pthread_mutex_lock(&lock);
+    void* run = NULL;
+    for(int i = 0; i < num_regions && run == NULL; i++){
+        run = TakeRun(&regions[i], pages);
+    }
+    if(run == NULL){
+        HugePageRegion* region = AddRegion(pages);
+        if(region != NULL){
+            run = TakeRun(region, pages);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return run;
+}
+
+// Keeps at most one entirely free region, the others go back to the
+// kernel so their huge pages aren't stranded.
+void HugePagePool::releaseRun(void* p){
+    pthread_mutex_lock(&lock);
+    HugePageRegion* region = RegionOf(p);
+    if(region == NULL){
+        // Not one of ours, the header said otherwise
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    size_t first = ((char*)p - region->base) / HUGE_PAGE_SIZE;
+    size_t pages = region->run_pages[first] & ~SPAN_FREE_BIT;
+    if(first > 0 && (region->run_pages[first - 1] & SPAN_FREE_BIT)){
+        size_t left_pages = region->run_pages[first - 1] & ~SPAN_FREE_BIT;
+        first -= left_pages;
+        pages += left_pages;
+    }
+    if(first + pages < region->pages && (region->run_pages[first + pages] & SPAN_FREE_BIT)){
+        pages += region->run_pages[first + pages] & ~SPAN_FREE_BIT;
+    }
+    SetRun(region, first, pages, true);
+
+    if(pages == region->pages){
+        for(int i = 0; i < num_regions; i++){
+            if(&regions[i] != region && regions[i].run_pages[0] == (regions[i].pages | SPAN_FREE_BIT)){
+                munmap(region->base, region->pages * HUGE_PAGE_SIZE);
+                *region = regions[--num_regions];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
+////////////////////////////////////////////////////////
+/*
+                    Free Tree                 
+                                                      */
+////////////////////////////////////////////////////////
+
+// Red-black tree of free blocks ordered by (size, address), so the first
+// block of at least some size is the best fit, with ties going to the lowest
+// address. There are no parent links, the path from the root is kept on the
+// stack instead, so a node fits in next_free and prev_free: the left and the
+// right child. The colour is the low bit of the left child, as blocks are
+// 8 byte aligned.
+class FreeTree{
+public:
+    static void Insert(MallocMetadata** root, MallocMetadata* block);
+    static void Remove(MallocMetadata** root, MallocMetadata* block);
+    static MallocMetadata* LowerBound(MallocMetadata* root, size_t size);
+
+private:
+    static MallocMetadata* Left(MallocMetadata* node);
+    static MallocMetadata* Right(MallocMetadata* node);
+    static void SetLeft(MallocMetadata* node, MallocMetadata* left);
+    static void SetRight(MallocMetadata* node, MallocMetadata* right);
+    static bool IsRed(MallocMetadata* node);
+    static void SetRed(MallocMetadata* node, bool is_red);
+    static bool Less(MallocMetadata* a, MallocMetadata* b);
+    static void Replace(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node, MallocMetadata* child);
+    static void RotateLeft(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node);
+    static void RotateRight(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node);
+};
+
+MallocMetadata* FreeTree::Left(MallocMetadata* node){
+    return (MallocMetadata*)((uintptr_t)node->next_free() & ~(uintptr_t)1);
+}
+
+MallocMetadata* FreeTree::Right(MallocMetadata* node){
+    return node->prev_free();
+}
+
+void FreeTree::SetLeft(MallocMetadata* node, MallocMetadata* left){
+    node->next_free() = (MallocMetadata*)((uintptr_t)left | ((uintptr_t)node->next_free() & 1));
+}
+
+void FreeTree::SetRight(MallocMetadata* node, MallocMetadata* right){
+    node->prev_free() = right;
+}
+
+bool FreeTree::IsRed(MallocMetadata* node){
+    return node != NULL && ((uintptr_t)node->next_free() & 1);
+}
+
+void FreeTree::SetRed(MallocMetadata* node, bool is_red){
+    node->next_free() = (MallocMetadata*)(((uintptr_t)node->next_free() & ~(uintptr_t)1) | is_red);
+}
+
+bool FreeTree::Less(MallocMetadata* a, MallocMetadata* b){
+    return a->size < b->size || (a->size == b->size && a < b);
+}
+
+// Puts child in the place of node, below parent or at the root.
+void FreeTree::Replace(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node, MallocMetadata* child){
+    if(parent == NULL){
+        *root = child;
+    }
+    else if(Left(parent) == node){
+        SetLeft(parent, child);
+    }
+    else{
+        SetRight(parent, child);
+    }
+}
+
+void FreeTree::RotateLeft(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node){
+    MallocMetadata* right = Right(node);
+    SetRight(node, Left(right));
+    SetLeft(right, node);
+    Replace(root, parent, node, right);
+}
+
+void FreeTree::RotateRight(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* node){
+    MallocMetadata* left = Left(node);
+    SetLeft(node, Right(left));
+    SetRight(left, node);
+    Replace(root, parent, node, left);
+}
+
+void FreeTree::Insert(MallocMetadata** root, MallocMetadata* block){
+    MallocMetadata* path[FREE_TREE_MAX_DEPTH];
+    int depth = 0;
+    for(MallocMetadata* curr = *root; curr != NULL; curr = Less(block, curr) ? Left(curr) : Right(curr)){
+        path[depth++] = curr;
+    }
+
+    block->next_free() = NULL;
+    block->prev_free() = NULL;
+    SetRed(block, true);
+    if(depth == 0){
+        *root = block;
+    }
+    else if(Less(block, path[depth - 1])){
+        SetLeft(path[depth - 1], block);
+    }
+    else{
+        SetRight(path[depth - 1], block);
+    }
+
+    // Fix a red node below a red parent, which is never the root
+    MallocMetadata* node = block;
+    while(depth > 0 && IsRed(path[depth - 1])){
+        MallocMetadata* parent = path[depth - 1];
+        MallocMetadata* grand = path[depth - 2];
+        MallocMetadata* great = depth > 2 ? path[depth - 3] : NULL;
+        bool parent_is_left = Left(grand) == parent;
+        MallocMetadata* uncle = parent_is_left ? Right(grand) : Left(grand);
+        if(IsRed(uncle)){
+            SetRed(parent, false);
+            SetRed(uncle, false);
+            SetRed(grand, true);
+            node = grand;
+            depth -= 2;
+            continue;
+        }
+        if(parent_is_left){
+            if(Right(parent) == node){
+                RotateLeft(root, grand, parent);
+                parent = node;
+            }
+            RotateRight(root, great, grand);
+        }
+        else{
+            if(Left(parent) == node){
+                RotateRight(root, grand, parent);
+                parent = node;
+            }
+            RotateLeft(root, great, grand);
+        }
+        SetRed(parent, false);
+        SetRed(grand, true);
+        break;
+    }
+    SetRed(*root, false);
+}
+
+void FreeTree::Remove(MallocMetadata** root, MallocMetadata* block){
+    MallocMetadata* path[FREE_TREE_MAX_DEPTH];
+    int depth = 0;
+    MallocMetadata* curr = *root;
+    while(curr != block){
+        if(curr == NULL){
+            exit(DEADBEEF);
+        }
+        path[depth++] = curr;
+        curr = Less(block, curr) ? Left(curr) : Right(curr);
+    }
+
+    // A block with two children first trades places with the next block in
+    // order, which has no left child.
+    if(Left(block) != NULL && Right(block) != NULL){
+        int block_depth = depth;
+        path[depth++] = block;
+        MallocMetadata* next = Right(block);
+        while(Left(next) != NULL){
+            path[depth++] = next;
+            next = Left(next);
+        }
+        MallocMetadata* next_right = Right(next);
+        bool next_is_red = IsRed(next);
+        Replace(root, block_depth > 0 ? path[block_depth - 1] : NULL, block, next);
+        SetLeft(next, Left(block));
+        if(Right(block) == next){
+            SetRight(next, block);
+        }
+        else{
+            SetRight(next, Right(block));
+            SetLeft(path[depth - 1], block);
+        }
+        SetRed(next, IsRed(block));
+        path[block_depth] = next;
+        SetLeft(block, NULL);
+        SetRight(block, next_right);
+        SetRed(block, next_is_red);
+    }
+
+    MallocMetadata* parent = depth > 0 ? path[depth - 1] : NULL;
+    MallocMetadata* node = Left(block) != NULL ? Left(block) : Right(block);
+    Replace(root, parent, block, node);
+    bool block_is_red = IsRed(block);
+    block->next_free() = NULL;
+    block->prev_free() = NULL;
+    if(block_is_red){
+        return;
+    }
+
+    // Taking out a black block leaves node one black short. Its sibling
+    // can't be empty then, even when node is.
+    while(depth > 0 && !IsRed(node)){
+        parent = path[depth - 1];
+        MallocMetadata* grand = depth > 1 ? path[depth - 2] : NULL;
+        bool node_is_left = Left(parent) == node;
+        MallocMetadata* sibling = node_is_left ? Right(parent) : Left(parent);
+        if(IsRed(sibling)){
+            SetRed(sibling, false);
+            SetRed(parent, true);
+            if(node_is_left){
+                RotateLeft(root, grand, parent);
+            }
+            else{
+                RotateRight(root, grand, parent);
+            }
+            path[depth - 1] = sibling;
+            path[depth++] = parent;
+            grand = sibling;
+            sibling = node_is_left ? Right(parent) : Left(parent);
+        }
+        MallocMetadata* near = node_is_left ? Left(sibling) : Right(sibling);
+        MallocMetadata* far = node_is_left ? Right(sibling) : Left(sibling);
+        if(!IsRed(near) && !IsRed(far)){
+            SetRed(sibling, true);
+            node = parent;
+            depth--;
+            continue;
+        }
+        if(!IsRed(far)){
+            SetRed(near, false);
+            SetRed(sibling, true);
+            if(node_is_left){
+                RotateRight(root, parent, sibling);
+            }
+            else{
+                RotateLeft(root, parent, sibling);
+            }
+            far = sibling;
+            sibling = near;
+        }
+        SetRed(sibling, IsRed(parent));
+        SetRed(parent, false);
+        SetRed(far, false);
+        if(node_is_left){
+            RotateLeft(root, grand, parent);
+        }
+        else{
+            RotateRight(root, grand, parent);
+        }
+        return;
+    }
+    if(node != NULL){
+        SetRed(node, false);
+    }
+}
+
+// The first block of at least size, NULL if there is none.
+MallocMetadata* FreeTree::LowerBound(MallocMetadata* root, size_t size){
+    MallocMetadata* best = NULL;
+    while(root != NULL){
+        if(root->size >= size){
+            best = root;
+            root = Left(root);
+        }
+        else{
+            root = Right(root);
+        }
+    }
+    return best;
+}
+
+
+class AllocedBlocksList{
+    public:
+        MallocMetadata* wilderness_block;
+        int cookie_code;
+
+        size_t fl_bitmap;
+        unsigned int sl_bitmap[TLSF_FL_COUNT];
+        MallocMetadata* free_blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+        // Kept up to date by every path that changes a block, so the
+        // statistics don't walk the lists. A block is free exactly while it
+        // is in the free index.
+        size_t stat_free_blocks;
+        size_t stat_free_bytes;
+        size_t stat_allocated_blocks;
+        size_t stat_allocated_bytes;
+
+        // Parked blocks by exact size, linked through next_free. They
+        // count as free blocks in the statistics.
+        MallocMetadata* quick_lists[QUICK_NUM_LISTS];
+        size_t quick_blocks;
+        size_t quick_bytes;
+
+        // The heap ends at region_brk. Unless the program break moves by
+        // exact requests, memory up to break_end is already usable: it is the
+        // real program break, or the committed end of the current segment,
+        // which is reserved up to region_end.
+        bool use_sbrk;
+        char* region_brk;
+        char* region_end;
+        char* break_end;
+        size_t grow_step;
+        unsigned char arena_id;
+        pthread_mutex_t lock;
+
+        // Blocks freed by threads that don't own the arena, linked through
+        // next_free. Kept on a line of its own so remote frees don't bounce
+        // the lines the owner works on.
+        alignas(64) std::atomic<MallocMetadata*> remote_frees;
+
+        AllocedBlocksList(bool use_sbrk = USE_SBRK_HEAP, unsigned char arena_id = 0);
+        ~AllocedBlocksList() = default;
+    
+        void* MoreCore(size_t increment);
+        void* GrowBreak(size_t increment);
+        void* GrowSegment(size_t increment);
+        void* CurrentBreak();
+        void* allocateBlock(size_t size, int is_scalloc = 0);
+        void* handOutBlock(void* block, size_t size, int is_scalloc);
+        void PushRemoteFree(MallocMetadata* block);
+        void DrainRemoteFrees();
+        void* insertBlock(size_t size, MallocMetadata* block = nullptr, bool is_free = 0);
+        void* allocateFreeBlock(size_t size);
+        static void MappingIndex(size_t size, int* fl, int* sl);
+        void InsertFreeBlock(MallocMetadata* block);
+        void RemoveFreeBlock(MallocMetadata* block);
+        MallocMetadata* FindFreeBlock(size_t size);
+        void releaseBlock(void* ptr);
+        void releaseRegularBlock(void* ptr);
+        void CoalesceBlock(MallocMetadata* block);
+        void ParkBlock(MallocMetadata* block);
+        MallocMetadata* UnparkBlock(size_t size);
+        void Consolidate();
+        void* SplitAndInsert(size_t new_size, MallocMetadata* old_block);
+        void RemoveBlock(MallocMetadata* block);
+        MallocMetadata* NextPhysical(MallocMetadata* block);
+        MallocMetadata* PrevPhysical(MallocMetadata* block);
+        MallocMetadata* GetNextIfFree(MallocMetadata* ptr);
+        MallocMetadata* GetPrevIfFree(MallocMetadata* ptr);
+        void MergeBlocks(MallocMetadata* first, MallocMetadata* second);
+        bool ExtendWilderness(size_t size);
+        void UnionAndInsert(MallocMetadata* curr, MallocMetadata* next, MallocMetadata* prev, bool isfree = 1);
+        void* insertLargeBlock(size_t size, int is_scalloc = 0);
+        void releaseLargeBlock(void* ptr);
+        void VerifyCookieCode(MallocMetadata* block);
+        void* ReallocateRegularBlock(MallocMetadata* block, size_t size);
+        void* ReallocateLargeBlock(MallocMetadata* block, size_t size);
+
+        size_t num_free_blocks();
+        size_t num_free_bytes();
+        size_t num_allocated_blocks();
+        size_t num_allocated_bytes();
+        size_t num_meta_data_bytes();
+        size_t num_unused_top_bytes();
+        size_t size_meta_data();
+
+        MallocMetadata* data_to_meta(void* p);
+        void* meta_to_data(MallocMetadata* p);
+};
+
+AllocedBlocksList::AllocedBlocksList(bool use_sbrk, unsigned char arena_id) :
+                                         wilderness_block(nullptr), cookie_code(rand() & 0xff),
+                                         fl_bitmap(0), sl_bitmap(), free_blocks(),
+                                         stat_free_blocks(0), stat_free_bytes(0), stat_allocated_blocks(0), stat_allocated_bytes(0),
+                                         quick_lists(), quick_blocks(0), quick_bytes(0),
+                                         use_sbrk(use_sbrk), region_brk(nullptr), region_end(nullptr), break_end(nullptr), grow_step(HEAP_GROW_MIN), arena_id(arena_id),
+                                         remote_frees(nullptr) {
+    // Recursive, since srealloc may allocate from and free to its own arena
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Moves the end of the heap the way sbrk does, through the program break
+// or through segments, and enters the new pages in the page map.
+void* AllocedBlocksList::MoreCore(size_t increment){
+    void* old_brk;
+    if(!use_sbrk){
+        old_brk = GrowSegment(increment);
+    }
+    else{
+        old_brk = USE_THP_HEAP || !HEAP_STRICT_SBRK ? GrowBreak(increment) : sbrk(increment);
+    }
+    // The memory is left unused then, insertBlock sees it as a gap
+    if(old_brk != (void*)-1 && increment > 0 && !pageMap.set(old_brk, increment, PAGE_HEAP, arena_id)){
+        return (void*)-1;
+    }
+    return old_brk;
+}
+
+void* AllocedBlocksList::CurrentBreak(){
+    return use_sbrk && !USE_THP_HEAP && HEAP_STRICT_SBRK ? sbrk(0) : region_brk;
+}
+
+// Commits the current segment further, or reserves a new one when it is
+// used up. A new segment is not contiguous with the old one, which
+// insertBlock handles like a foreign program break move.
+void* AllocedBlocksList::GrowSegment(size_t increment){
+    if(region_brk == nullptr || increment > (size_t)(region_end - region_brk)){
+        size_t length = HEAP_SEGMENT_SIZE;
+        if(increment > length){
+            length = (increment + HEAP_COMMIT_STEP - 1) & ~(HEAP_COMMIT_STEP - 1);
+        }
+        char* segment = (char*)mapAligned(length, USE_THP_HEAP ? HUGE_PAGE_SIZE : getpagesize(), PROT_NONE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+        if(segment == (void*)-1){
+            return (void*)-1;
+        }
+        if(USE_THP_HEAP){
+            madvise(segment, length, MADV_HUGEPAGE);
+        }
+        region_brk = break_end = segment;
+        region_end = segment + length;
+    }
+    if(increment > (size_t)(break_end - region_brk)){
+        char* new_end = (char*)(((uintptr_t)region_brk + increment + HEAP_COMMIT_STEP - 1) & ~(HEAP_COMMIT_STEP - 1));
+        if(new_end > region_end){
+            new_end = region_end;
+        }
+        if(mprotect(break_end, new_end - break_end, PROT_READ | PROT_WRITE) != 0){
+            return (void*)-1;
+        }
+        break_end = new_end;
+    }
+    void* old_brk = region_brk;
+    region_brk += increment;
+    return old_brk;
+}
+
+// Hands out the program break from steps of grow_step bytes, that end on a
+// huge page boundary with USE_THP_HEAP. If something else moved the break,
+// the heap continues from there, and insertBlock sees the gap.
+void* AllocedBlocksList::GrowBreak(size_t increment){
+    if(break_end == nullptr || increment > (size_t)(break_end - region_brk)){
+        char* current = (char*)sbrk(0);
+        if(current != break_end){
+            region_brk = break_end = current;
+        }
+        size_t step = HEAP_STRICT_SBRK || increment > grow_step ? increment : grow_step;
+        uintptr_t alignment = USE_THP_HEAP ? HUGE_PAGE_SIZE : 1;
+        char* new_end = (char*)(((uintptr_t)region_brk + step + alignment - 1) & ~(alignment - 1));
+        if(sbrk(new_end - break_end) == (void*)-1){
+            // Maybe there is still room for the request alone
+            new_end = (char*)(((uintptr_t)region_brk + increment + alignment - 1) & ~(alignment - 1));
+            if(step == increment || sbrk(new_end - break_end) == (void*)-1){
+                return (void*)-1;
+            }
+        }
+        if(USE_THP_HEAP){
+            char* first_page = (char*)(((uintptr_t)break_end + getpagesize() - 1) & ~(uintptr_t)(getpagesize() - 1));
+            madvise(first_page, new_end - first_page, MADV_HUGEPAGE);
+        }
+        break_end = new_end;
+        if(grow_step < HEAP_GROW_MAX){
+            grow_step *= 2;
+        }
+    }
+    void* old_brk = region_brk;
+    region_brk += increment;
+    return old_brk;
+}
+
+// Lock-free, may be called by any thread without holding the arena lock.
+void AllocedBlocksList::PushRemoteFree(MallocMetadata* block){
+    MallocMetadata* first = remote_frees.load(std::memory_order_relaxed);
+    do {
+        block->next_free() = first;
+    } while(!remote_frees.compare_exchange_weak(first, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Takes the whole list at once, so there is a single consumer and no ABA.
+// Must be called with the arena lock held.
+void AllocedBlocksList::DrainRemoteFrees(){
+    MallocMetadata* block = remote_frees.exchange(nullptr, std::memory_order_acquire);
+    while(block != nullptr){
+        MallocMetadata* next = block->next_free();
+        block->setReleased(0);
+        releaseRegularBlock(meta_to_data(block));
+        block = next;
+    }
+}
+
+void* AllocedBlocksList::allocateBlock(size_t size, int is_scalloc){
+    if(use_sbrk){
+        alignFirstUse();
+    }
+    if(remote_frees.load(std::memory_order_relaxed) != nullptr){
+        DrainRemoteFrees();
+    }
+
+    if (size >= LARGE_BLOCK) {
+        return handOutBlock(insertLargeBlock(size, is_scalloc), size, is_scalloc);
+    }
+    size_t requested_size = size;
+    ALIGN_SIZE(size);
+    if (size < FREE_LINKS_SIZE) {
+        size = FREE_LINKS_SIZE;
+    }
+    if (USE_QUICK_LISTS && size <= QUICK_MAX_SIZE) {
+        MallocMetadata* parked = UnparkBlock(size);
+        if (parked != NULL) {
+            return handOutBlock(meta_to_data(parked), requested_size, is_scalloc);
+        }
+    }
+    void* new_block = allocateFreeBlock(size);
+    if (new_block == NULL && USE_QUICK_LISTS && quick_blocks > 0) {
+        Consolidate();
+        new_block = allocateFreeBlock(size);
+    }
+
+    if(new_block == NULL){
+        new_block = insertBlock(size);
+    }
+    else if (data_to_meta(new_block)->size - size >= (MIN_SPLIT_SIZE + size_meta_data())) {
+        new_block = SplitAndInsert(size, data_to_meta(new_block));
+    }
+
+    return handOutBlock(new_block, requested_size, is_scalloc);
+}
+
+// Zeroes the block for scalloc unless it is known to be zero already. Once
+// handed out it may be written to, so it stops being known zero.
+void* AllocedBlocksList::handOutBlock(void* block, size_t size, int is_scalloc){
+    if(block == NULL){
+        return NULL;
+    }
+    MallocMetadata* meta_data_ptr = data_to_meta(block);
+    if(is_scalloc && !meta_data_ptr->is_zero){
+        std::memset(block, 0, size);
+    }
+    meta_data_ptr->is_zero = 0;
+    return block;
+}
+
+MallocMetadata* AllocedBlocksList::data_to_meta(void* p){
+    MallocMetadata* meta_data_ptr = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
+    VerifyCookieCode(meta_data_ptr);
+    return meta_data_ptr;
+}
+
+void* AllocedBlocksList::meta_to_data(MallocMetadata* p){
+    VerifyCookieCode(p);
+    return (char*)p + sizeof(MallocMetadata);
+}
+
+void AllocedBlocksList::VerifyCookieCode(MallocMetadata* block){
+    if(block == NULL){
+        return;
+    }
+    if(block->cookie != cookie_code){
+        exit(DEADBEEF);
+    }
+}
+
+void* AllocedBlocksList::insertBlock(size_t size, MallocMetadata* new_block, bool is_free)
+{   
+    if (new_block == nullptr) {
+        if (wilderness_block != nullptr && wilderness_block->is_free && ExtendWilderness(size)) {
+            RemoveBlock(wilderness_block);
+            new_block = wilderness_block;
+        } else {
+            char* heap_end = wilderness_block == nullptr ? nullptr : (char*)wilderness_block + size_meta_data() + wilderness_block->size;
+            new_block = (MallocMetadata*)MoreCore(size_meta_data() + size);
+            if(new_block == (void*)-1) {
+                return NULL;
+            }
+            // If someone else moved the program break, the old wilderness
+            // is no longer followed by our memory.
+            new_block->prev_size = 0;
+            new_block->is_last = 0;
+            new_block->is_zero = 1;
+            if (wilderness_block != nullptr) {
+                if ((char*)new_block == heap_end) {
+                    new_block->prev_size = wilderness_block->size;
+                } else {
+                    wilderness_block->is_last = 1;
+                }
+            }
+            wilderness_block = new_block;
+        }
+    }
+    new_block->cookie = this->cookie_code;
+    new_block->is_free = 0;
+    new_block->is_mmap = 0;
+    new_block->is_huge = 0;
+    new_block->is_span = 0;
+    new_block->is_quick = 0;
+    new_block->setReleased(0);
+    new_block->size = size;
+    stat_allocated_blocks++;
+    stat_allocated_bytes += size;
+
+    MallocMetadata* next_block = NextPhysical(new_block);
+    if (next_block != NULL) {
+        next_block->prev_size = new_block->size;
+    }
+
+    if (is_free) {
+        InsertFreeBlock(new_block);
+    }
+    return meta_to_data(new_block);
+}
+
+void AllocedBlocksList::MappingIndex(size_t size, int* fl, int* sl) {
+    if (size < TLSF_SMALL_SIZE) {
+        *fl = 0;
+        *sl = (int)(size >> TLSF_ALIGN_LOG);
+        return;
+    }
+    int msb = 63 - __builtin_clzl(size);
+    *fl = msb - TLSF_FL_SHIFT + 1;
+    *sl = (int)((size >> (msb - TLSF_SL_LOG)) ^ TLSF_SL_COUNT);
+}
+
+void AllocedBlocksList::InsertFreeBlock(MallocMetadata* block) {
+    int fl, sl;
+    MappingIndex(block->size, &fl, &sl);
+    block->is_free = 1;
+    block->setReleased(1);
+    stat_free_blocks++;
+    stat_free_bytes += block->size;
+    FreeTree::Insert(&free_blocks[fl][sl], block);
+    fl_bitmap |= (size_t)1 << fl;
+    sl_bitmap[fl] |= 1U << sl;
+}
+
+void AllocedBlocksList::RemoveFreeBlock(MallocMetadata* block) {
+    int fl, sl;
+    MappingIndex(block->size, &fl, &sl);
+    VerifyCookieCode(block);
+    block->is_free = 0;
+    block->setReleased(0);
+    stat_free_blocks--;
+    stat_free_bytes -= block->size;
+    // Clears the links, so a block that was known to be zero still is
+    FreeTree::Remove(&free_blocks[fl][sl], block);
+    if (free_blocks[fl][sl] == NULL) {
+        sl_bitmap[fl] &= ~(1U << sl);
+        if (sl_bitmap[fl] == 0) {
+            fl_bitmap &= ~((size_t)1 << fl);
+        }
+    }
+}
+
+MallocMetadata* AllocedBlocksList::FindFreeBlock(size_t size) {
+    int fl, sl;
+    MappingIndex(size, &fl, &sl);
+
+    // The bucket of the size itself may hold blocks both smaller and larger
+    // than the request, so it is the only one that has to be searched.
+    MallocMetadata* block = FreeTree::LowerBound(free_blocks[fl][sl], size);
+    if (block != NULL) {
+        VerifyCookieCode(block);
+        return block;
+    }
+
+    unsigned int sl_map = (sl + 1 < TLSF_SL_COUNT) ? sl_bitmap[fl] & (~0U << (sl + 1)) : 0;
+    if (sl_map == 0) {
+        size_t fl_map = (fl + 1 < TLSF_FL_COUNT) ? fl_bitmap & (~(size_t)0 << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    block = FreeTree::LowerBound(free_blocks[fl][sl], 0);
+    VerifyCookieCode(block);
+    return block;
+}
+
+void* AllocedBlocksList::allocateFreeBlock(size_t size){
+    MallocMetadata* block = FindFreeBlock(size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    RemoveFreeBlock(block);
+    return meta_to_data(block);
+}
+
+MallocMetadata* AllocedBlocksList::NextPhysical(MallocMetadata* block) {
+    // The wilderness block ends the heap, and is_last marks a block that
+    // is followed by memory we don't own.
+    if (block == wilderness_block || block->is_last) {
+        return NULL;
+    }
+    return (MallocMetadata*)((char*)block + block->size + size_meta_data());
+}
+
+MallocMetadata* AllocedBlocksList::PrevPhysical(MallocMetadata* block) {
+    if (block->prev_size == 0) {
+        return NULL;
+    }
+    return (MallocMetadata*)((char*)block - block->prev_size - size_meta_data());
+}
+
+MallocMetadata* AllocedBlocksList::GetNextIfFree(MallocMetadata* ptr) {
+    VerifyCookieCode(ptr);
+    MallocMetadata* next = NextPhysical(ptr);
+    VerifyCookieCode(next);
+    return (next != NULL && next->is_free) ? next : nullptr;
+}
+
+MallocMetadata* AllocedBlocksList::GetPrevIfFree(MallocMetadata* ptr) {
+    VerifyCookieCode(ptr);
+    MallocMetadata* prev = PrevPhysical(ptr);
+    VerifyCookieCode(prev);
+    return (prev != NULL && prev->is_free) ? prev : nullptr;
+}
+
+void AllocedBlocksList::MergeBlocks(MallocMetadata* first, MallocMetadata* second) {
+    // Both blocks must already be out of the lists, the caller re-inserts first.
+    first->size += second->size + size_meta_data();
+    first->is_last = second->is_last;
+    if (second == wilderness_block) {
+        wilderness_block = first;
+    }
+    // The header of second becomes payload, clear it to keep first zero.
+    first->is_zero = first->is_zero && second->is_zero;
+    if (first->is_zero) {
+        std::memset(second, 0, size_meta_data());
+    }
+}
+
+bool AllocedBlocksList::ExtendWilderness(size_t size) {
+    char* heap_end = (char*)wilderness_block + size_meta_data() + wilderness_block->size;
+    if (CurrentBreak() != heap_end) {
+        return false;
+    }
+    if (MoreCore(size - wilderness_block->size) == (void*)-1) {
+        return false;
+    }
+
+    bool was_free = wilderness_block->is_free;
+    if (was_free) {
+        RemoveFreeBlock(wilderness_block);
+    }
+    stat_allocated_bytes += size - wilderness_block->size;
+    wilderness_block->size = size;
+    if (was_free) {
+        InsertFreeBlock(wilderness_block);
+    }
+    return true;
+}
+
+void AllocedBlocksList::UnionAndInsert(MallocMetadata* curr, MallocMetadata* next, MallocMetadata* prev, bool isfree) {
+    int situation = 0;
+    RemoveBlock(curr);
+    if(next != NULL){
+        RemoveBlock(next);
+        situation+= 1;
+    }
+    if(prev != NULL){
+        RemoveBlock(prev);
+        situation+= 2;
+    }
+
+    switch(situation){
+        case 1: // Union curr and next
+            MergeBlocks(curr, next);
+            insertBlock(curr->size, curr, isfree);
+            break;
+        case 2: // Union curr and prev
+            MergeBlocks(prev, curr);
+            insertBlock(prev->size, prev, isfree);
+            break;
+        case 3: // Union curr, next and prev
+            MergeBlocks(prev, curr);
+            MergeBlocks(prev, next);
+            insertBlock(prev->size, prev, isfree);
+            break;
+    }
+
+    return;
+}
+
+void AllocedBlocksList::releaseBlock(void* ptr){
+    if(ptr == NULL){
+        return;
+    }
+    MallocMetadata* meta_data_ptr = data_to_meta(ptr);
+    if(meta_data_ptr->is_mmap){
+        releaseLargeBlock(ptr);
+    }
+    else{
+        releaseRegularBlock(ptr);
+    }
+}
+
+void AllocedBlocksList::releaseRegularBlock(void* ptr){
+    MallocMetadata* meta_data_ptr = data_to_meta(ptr);
+    if(meta_data_ptr->isReleased()){
+        return;
+    }
+    meta_data_ptr->is_zero = 0;
+    if(USE_QUICK_LISTS && meta_data_ptr->size <= QUICK_MAX_SIZE){
+        ParkBlock(meta_data_ptr);
+    }
+    else{
+        CoalesceBlock(meta_data_ptr);
+    }
+}
+
+// Frees the block into the free index, merged with its free neighbours.
+// Parked neighbours aren't free in the heap's eyes, they are merged when
+// they are consolidated themselves.
+void AllocedBlocksList::CoalesceBlock(MallocMetadata* block){
+    MallocMetadata* next_free = this->GetNextIfFree(block);
+    MallocMetadata* prev_free = this->GetPrevIfFree(block);
+    
+    if(next_free != NULL ||  prev_free != NULL){
+        this->UnionAndInsert(block, next_free, prev_free);
+    }
+    else{
+        InsertFreeBlock(block);
+    }
+}
+
+void AllocedBlocksList::ParkBlock(MallocMetadata* block){
+    int index = block->size / 8 - 1;
+    block->is_quick = 1;
+    block->setReleased(1);
+    block->next_free() = quick_lists[index];
+    quick_lists[index] = block;
+    quick_blocks++;
+    quick_bytes += block->size;
+    if(quick_bytes > QUICK_MIN_BYTES && quick_bytes > stat_free_bytes){
+        Consolidate();
+    }
+}
+
+// The most recently parked block of exactly size, NULL if there is none.
+MallocMetadata* AllocedBlocksList::UnparkBlock(size_t size){
+    int index = size / 8 - 1;
+    MallocMetadata* block = quick_lists[index];
+    if(block == NULL){
+        return NULL;
+    }
+    VerifyCookieCode(block);
+    quick_lists[index] = block->next_free();
+    block->next_free() = NULL;
+    block->is_quick = 0;
+    block->setReleased(0);
+    quick_blocks--;
+    quick_bytes -= block->size;
+    return block;
+}
+
+// Frees every parked block the way sfree would have without quick lists.
+void AllocedBlocksList::Consolidate(){
+    for(int index = 0; index < QUICK_NUM_LISTS; index++){
+        MallocMetadata* block = quick_lists[index];
+        quick_lists[index] = NULL;
+        while(block != NULL){
+            VerifyCookieCode(block);
+            MallocMetadata* next = block->next_free();
+            block->next_free() = NULL;
+            block->is_quick = 0;
+            CoalesceBlock(block);
+            block = next;
+        }
+    }
+    quick_blocks = 0;
+    quick_bytes = 0;
+}
+
+void AllocedBlocksList::RemoveBlock(MallocMetadata* block) {
+    VerifyCookieCode(block);
+    if (block->is_free) {
+        RemoveFreeBlock(block);
+    }
+    stat_allocated_blocks--;
+    stat_allocated_bytes -= block->size;
+}
+
+
+void* AllocedBlocksList::SplitAndInsert(size_t new_size, MallocMetadata* old_block) {
+    VerifyCookieCode(old_block);
+    RemoveBlock(old_block);
+    MallocMetadata* free_block = (MallocMetadata*)((char*)old_block + new_size + size_meta_data());
+    free_block->prev_size = new_size;
+    free_block->is_last = old_block->is_last;
+    free_block->is_zero = old_block->is_zero;
+    old_block->is_last = 0;
+    if (old_block == wilderness_block) {
+        wilderness_block = free_block;
+    }
+    insertBlock(old_block->size - new_size - size_meta_data(), free_block, 1);
+
+    // Don't merge after split
+    // MallocMetadata* next_free = GetNextIfFree(free_block);
+    // if(next_free != NULL){
+    //     UnionAndInsert(free_block, next_free, NULL);
+    // }
+    insertBlock(new_size, old_block);
+    return meta_to_data(old_block);
+}
+
+void* AllocedBlocksList::insertLargeBlock(size_t size, int is_scalloc) {
+    MallocMetadata* new_large_block = NULL;
+    bool is_huge = (!is_scalloc && size >= HUGE_SIZE_MALLOC) || (is_scalloc && size >= HUGE_SIZE_SCALLOC);
+    size_t length = sizeof(*new_large_block) + size;
+    size_t reserved_length = 0;
+    bool is_span = false;
+    // Fresh mappings are zero, reused ones aren't
+    bool is_new = false;
+    if (is_huge && USE_THP_FALLBACK) {
+        int backoff = hugetlb_backoff.load(std::memory_order_relaxed);
+        while (backoff > 0 && !hugetlb_backoff.compare_exchange_weak(backoff, backoff - 1, std::memory_order_relaxed)) {
+        }
+        is_huge = backoff <= 0;
+    }
+    if (is_huge) {
+        if (USE_HUGE_POOL) {
+            new_large_block = (MallocMetadata*)hugePagePool.allocateRun(length);
+            is_span = new_large_block != NULL;
+            if (is_span) {
+                length = (length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+            }
+        }
+        if (new_large_block == NULL) {
+            // The kernel rounds hugetlb mappings up anyway, and the header
+            // keeps lengths in whole pages
+            length = (length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+            new_large_block = (MallocMetadata*)mmap(NULL ,length, PROT_READ | PROT_WRITE, HUGETLB_MAP_FLAGS, -1, 0);
+            is_new = true;
+        }
+        if (new_large_block == (void*)-1 && USE_THP_FALLBACK) {
+            hugetlb_backoff.store(HUGETLB_RETRY_INTERVAL, std::memory_order_relaxed);
+            new_large_block = NULL;
+            is_huge = false;
+        }
+    }
+    if (!is_huge) {
+        length = (length + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+        bool want_thp = USE_THP_FALLBACK && length >= HUGE_PAGE_SIZE;
+        size_t alignment = want_thp ? HUGE_PAGE_SIZE : getpagesize();
+        // Spans aren't huge page aligned
+        if (USE_SPAN_ALLOCATOR && SPAN_SERVES(length)) {
+            new_large_block = (MallocMetadata*)spanAllocator.allocateSpan(length);
+            is_span = new_large_block != NULL;
+        }
+        if (new_large_block == NULL && USE_LARGE_CACHE) {
+            new_large_block = (MallocMetadata*)largeBlockCache.Take(length, &length);
+        }
+        if (new_large_block == NULL && USE_LARGE_HEADROOM) {
+            size_t headroom = (length / 100 * LARGE_HEADROOM_PERCENT + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+            reserved_length = length + headroom;
+            new_large_block = (MallocMetadata*)mapAligned(reserved_length, alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+            if (new_large_block != (void*)-1 && mprotect(new_large_block, length, PROT_READ | PROT_WRITE) != 0) {
+                munmap(new_large_block, reserved_length);
+                new_large_block = (MallocMetadata*)-1;
+            }
+            is_new = true;
+        }
+        if (new_large_block == NULL) {
+            new_large_block = (MallocMetadata*)mapAligned(length, alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+            is_new = true;
+        }
+        if (want_thp && is_new && new_large_block != (void*)-1) {
+            madvise(new_large_block, length, MADV_HUGEPAGE);
+        }
+    }
+
+    if (new_large_block == (void*)-1){
+        return NULL;
+    }
+    if (is_huge) {
+        num_hugetlb_blocks.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if (length >= HUGE_PAGE_SIZE) {
+        // A reused mapping may not have been aligned
+        bool is_thp = USE_THP_FALLBACK && ((uintptr_t)new_large_block & (HUGE_PAGE_SIZE - 1)) == 0;
+        (is_thp ? num_thp_blocks : num_base_page_blocks).fetch_add(1, std::memory_order_relaxed);
+    }
+    new_large_block->cookie = this->cookie_code;
+    new_large_block->is_free = 0;
+    new_large_block->is_mmap = 1;
+    new_large_block->is_huge = is_huge;
+    new_large_block->is_span = is_span;
+    new_large_block->is_zero = is_new;
+    new_large_block->setMapLengths(length, reserved_length > length ? reserved_length : length);
+    new_large_block->is_quick = 0;
+    new_large_block->setReleased(0);
+    new_large_block->size = size;
+    stat_allocated_blocks++;
+    stat_allocated_bytes += size;
+    if (!pageMap.set(meta_to_data(new_large_block), 1, PAGE_MMAP, arena_id)) {
+        releaseLargeBlock(meta_to_data(new_large_block));
+        return NULL;
+    }
+    return meta_to_data(new_large_block);
+}
+
+void AllocedBlocksList::releaseLargeBlock(void* ptr){
+    MallocMetadata* meta_data_ptr = data_to_meta(ptr);
+    VerifyCookieCode(meta_data_ptr);
+    pageMap.clear(ptr, 1);
+    stat_allocated_blocks--;
+    stat_allocated_bytes -= meta_data_ptr->size;
+
+    if (meta_data_ptr->is_span && meta_data_ptr->is_huge) {
+        hugePagePool.releaseRun(meta_data_ptr);
+        return;
+    }
+    if (meta_data_ptr->is_span) {
+        spanAllocator.releaseSpan(meta_data_ptr);
+        return;
+    }
+    size_t length = meta_data_ptr->mapLength();
+    size_t reserved_length = meta_data_ptr->reservedLength();
+    if (reserved_length > length) {
+        munmap((char*)meta_data_ptr + length, reserved_length - length);
+    }
+    if (USE_LARGE_CACHE && !meta_data_ptr->is_huge && largeBlockCache.Put(meta_data_ptr, length)) {
+        return;
+    }
+    munmap(meta_data_ptr, length);
+}
+
+void* AllocedBlocksList::ReallocateRegularBlock(MallocMetadata* block, size_t size){
+    if(size < FREE_LINKS_SIZE){
+        size = FREE_LINKS_SIZE;
+    }
+    if(block->size >= size){ // 1.a
+        if(block->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
+            SplitAndInsert(size, block);
+        }
+        return meta_to_data(block);
+    }
+
+    MallocMetadata* next = GetNextIfFree(block);
+    MallocMetadata* prev = GetPrevIfFree(block);
+
+    if(prev != NULL){ // 1.b
+        if(block->size + prev->size + size_meta_data() >= size){ // 1.b no wilderness
+            RemoveBlock(block);
+            RemoveBlock(prev);
+            MergeBlocks(prev, block);
+            insertBlock(prev->size, prev);
+            // Move before splitting, the new free block's header may land inside the old data
+            copyMemory(meta_to_data(prev), meta_to_data(block), block->size);
+            if(prev->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
+                SplitAndInsert(size, prev);
+            }
+            return meta_to_data(prev);
+        }
+        else if(block == wilderness_block){ // 1.b with wilderness
+            size_t old_size = block->size;
+            if(ExtendWilderness(size - prev->size - size_meta_data())){
+                RemoveBlock(block);
+                RemoveBlock(prev);
+                MergeBlocks(prev, block);
+                insertBlock(prev->size, prev);
+                copyMemory(meta_to_data(prev), meta_to_data(block), old_size);
+                return meta_to_data(prev);
+            }
+        }
+    }
+    else if(block == wilderness_block && ExtendWilderness(size)){  // 1.c
+        return meta_to_data(wilderness_block);
+    }
+
+    if(next != NULL){ // 1.d
+        if(block->size + next->size + size_meta_data() >= size){
+            RemoveBlock(block);
+            RemoveBlock(next);
+            MergeBlocks(block, next);
+            insertBlock(block->size, block);
+            if(block->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
+                SplitAndInsert(size, block);
+            }
+            return meta_to_data(block);
+        }
+    }
+
+    if(prev != NULL && next != NULL){ // 1.e
+        if(block->size + prev->size + next->size + 2*size_meta_data() >= size){
+            UnionAndInsert(block, next, prev, 0);
+            copyMemory(meta_to_data(prev), meta_to_data(block), block->size);
+            if(prev->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
+                SplitAndInsert(size, prev);
+            }
+            return meta_to_data(prev);
+        }
+    }
+    
+    if(next != NULL && next == wilderness_block){ // 1.f
+        if(prev != NULL){ // 1.f1
+            if(ExtendWilderness(size - prev->size - block->size - 2*size_meta_data())){
+                UnionAndInsert(block, next, prev, 0);
+                copyMemory(meta_to_data(prev), meta_to_data(block), block->size);
+                return meta_to_data(prev);
+            }
+        }
+        else if(ExtendWilderness(size - block->size - size_meta_data())){ // 1.f2
+            UnionAndInsert(block, next, NULL, 0);
+            return meta_to_data(block);
+        }
+    }
+
+    void* new_block = allocateBlock(size); // g + h
+    if(new_block == NULL){
+        return NULL;
+    }
+
+    copyMemory(new_block, meta_to_data(block), block->size);
+    releaseRegularBlock(meta_to_data(block));
+
+    return new_block;
+}
+
+
+void* AllocedBlocksList::ReallocateLargeBlock(MallocMetadata* oldblock, size_t size){
+    VerifyCookieCode(oldblock);
+    if(oldblock->size == size){
+        return meta_to_data(oldblock);
+    }
+
+    bool is_huge = size >= HUGE_SIZE_MALLOC && !(USE_THP_FALLBACK && hugetlb_backoff.load(std::memory_order_relaxed) > 0);
+    if(size >= LARGE_BLOCK && oldblock->is_span && !oldblock->is_huge){
+        size_t length = (size_meta_data() + size + SPAN_PAGE_SIZE - 1) & ~(SPAN_PAGE_SIZE - 1);
+        if(SPAN_SERVES(length) && spanAllocator.resizeSpan(oldblock, oldblock->mapLength(), length)){
+            oldblock->setMapLengths(length, length);
+            stat_allocated_bytes += size - oldblock->size;
+            oldblock->size = size;
+            return meta_to_data(oldblock);
+        }
+    }
+    else if(size >= LARGE_BLOCK && is_huge == oldblock->is_huge){
+        size_t old_length = oldblock->mapLength();
+        size_t reserved_length = oldblock->reservedLength();
+        size_t length = (size_meta_data() + size + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+
+        if(is_huge && size_meta_data() + size <= old_length){
+            stat_allocated_bytes += size - oldblock->size;
+            oldblock->size = size;
+            return meta_to_data(oldblock);
+        }
+        if(!is_huge && length <= old_length){
+            // Shrink in place by giving back the pages past the new end. With
+            // headroom they are replaced by reserved address space.
+            if(length < old_length && reserved_length > old_length){
+                if(mmap((char*)oldblock + length, old_length - length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED){
+                    // The tail is in an unknown state, so the headroom goes too
+                    munmap((char*)oldblock + length, reserved_length - length);
+                    reserved_length = length;
+                }
+            }
+            else if(length < old_length){
+                munmap((char*)oldblock + length, old_length - length);
+                reserved_length = length;
+            }
+            oldblock->setMapLengths(length, reserved_length);
+            stat_allocated_bytes += size - oldblock->size;
+            oldblock->size = size;
+            return meta_to_data(oldblock);
+        }
+        if(!is_huge && length <= reserved_length &&
+           mprotect((char*)oldblock + old_length, length - old_length, PROT_READ | PROT_WRITE) == 0){
+            // Grow into the headroom, the block doesn't move
+            oldblock->setMapLengths(length, reserved_length);
+            stat_allocated_bytes += size - oldblock->size;
+            oldblock->size = size;
+            return meta_to_data(oldblock);
+        }
+        if(!is_huge){
+            // Out of headroom, mremap can't take it along
+            if(reserved_length > old_length){
+                munmap((char*)oldblock + old_length, reserved_length - old_length);
+                oldblock->setMapLengths(old_length, old_length);
+            }
+            // Grow by moving page table entries instead of copying the payload
+            MallocMetadata* new_block = (MallocMetadata*)mremap(oldblock, old_length, length, MREMAP_MAYMOVE);
+            if(new_block != MAP_FAILED){
+                // The old mapping is gone, so there is no going back if the
+                // new address can't be entered
+                if(new_block != oldblock){
+                    pageMap.clear((char*)oldblock + size_meta_data(), 1);
+                    if(!pageMap.set(meta_to_data(new_block), 1, PAGE_MMAP, arena_id)){
+                        exit(DEADBEEF);
+                    }
+                }
+                new_block->setMapLengths(length, length);
+                stat_allocated_bytes += size - new_block->size;
+                new_block->size = size;
+                return meta_to_data(new_block);
+            }
+        }
+    }
+
+    // Moving between the heap, normal mappings and hugetlb mappings copies
+    void* new_block = allocateBlock(size);
+    if(new_block == NULL){
+        return NULL;
+    }
+
+    copyMemory(new_block, meta_to_data(oldblock), size < oldblock->size ? size : oldblock->size);
+    releaseLargeBlock(meta_to_data(oldblock));
+
+    return new_block;
+}
+
+size_t AllocedBlocksList::num_unused_top_bytes() {
+    return break_end == nullptr ? 0 : break_end - region_brk;
+}
+
+size_t AllocedBlocksList::num_free_blocks() {
+    return stat_free_blocks + quick_blocks;
+}
+
+size_t AllocedBlocksList::num_free_bytes() {
+    return stat_free_bytes + quick_bytes;
+}
+
+size_t AllocedBlocksList::num_allocated_blocks() {
+    return stat_allocated_blocks;
+}
+
+size_t AllocedBlocksList::num_allocated_bytes() {
+    return stat_allocated_bytes;
+}
+
+size_t AllocedBlocksList::num_meta_data_bytes() {
+    return num_allocated_blocks() * size_meta_data();
+}
+
+size_t AllocedBlocksList::size_meta_data() {
+    return sizeof(MallocMetadata);
+}
+
+
+////////////////////////////////////////////////////////
+/*
+                    Slab Allocator                 
+                                                      */
+////////////////////////////////////////////////////////
+
+// Small requests are served from page sized slabs of equal sized objects.
+// The objects have no header: the slab header at the start of the page
+// holds the size class and a bitmap of the free slots.
+class SlabPage{
+public:
+    int cookie;
+    unsigned short object_size;
+    unsigned short num_slots;
+    unsigned short num_free;
+    SlabPage* next;
+    SlabPage* prev;
+    uint64_t free_map[SLAB_MAP_WORDS];
+};
+static_assert(sizeof(SlabPage) <= SLAB_HEADER_SIZE, "slab header doesn't fit");
+
+class SlabAllocator{
+    public:
+        char* region_start;
+        char* region_top;
+        char* region_end;
+        SlabPage* partial_slabs[SLAB_NUM_CLASSES];
+        SlabPage* empty_slabs;
+        int cookie_code;
+
+        size_t num_slabs;
+        size_t num_slots;
+        size_t num_free_slots;
+        size_t slot_bytes;
+        size_t free_slot_bytes;
+
+        SlabAllocator();
+        ~SlabAllocator() = default;
+
+        void* allocateObject(size_t size);
+        void releaseObject(void* ptr);
+        size_t objectSize(void* ptr);
+        SlabPage* NewSlab(size_t object_size);
+        void LinkSlab(SlabPage* slab);
+        void UnlinkSlab(SlabPage* slab);
+        SlabPage* ptr_to_slab(void* ptr);
+
+        size_t num_free_blocks();
+        size_t num_free_bytes();
+        size_t num_allocated_blocks();
+        size_t num_allocated_bytes();
+        size_t num_meta_data_bytes();
+};
+
+SlabAllocator::SlabAllocator() : region_start(nullptr), region_top(nullptr), region_end(nullptr), partial_slabs(), empty_slabs(nullptr),
+                                 cookie_code(rand()), num_slabs(0), num_slots(0), num_free_slots(0), slot_bytes(0), free_slot_bytes(0) {}
+
+SlabPage* SlabAllocator::ptr_to_slab(void* ptr){
+    SlabPage* slab = (SlabPage*)((unsigned long)ptr & ~(unsigned long)(SLAB_PAGE_SIZE - 1));
+    if(slab->cookie != cookie_code){
+        exit(DEADBEEF);
+    }
+    return slab;
+}
+
+size_t SlabAllocator::objectSize(void* ptr){
+    return ptr_to_slab(ptr)->object_size;
+}
+
+void SlabAllocator::LinkSlab(SlabPage* slab){
+    int size_class = slab->object_size / 8 - 1;
+    slab->prev = NULL;
+    slab->next = partial_slabs[size_class];
+    if(slab->next != NULL){
+        slab->next->prev = slab;
+    }
+    partial_slabs[size_class] = slab;
+}
+
+void SlabAllocator::UnlinkSlab(SlabPage* slab){
+    int size_class = slab->object_size / 8 - 1;
+    if(slab->prev != NULL){
+        slab->prev->next = slab->next;
+    }
+    else{
+        partial_slabs[size_class] = slab->next;
+    }
+    if(slab->next != NULL){
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+SlabPage* SlabAllocator::NewSlab(size_t object_size){
+    SlabPage* slab = empty_slabs;
+    if(slab != NULL){
+        empty_slabs = slab->next;
+    }
+    else{
+        // Reserve the whole slab region once, pages are only backed by
+        // memory when they are first touched.
+        if(region_start == nullptr){
+            void* region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(region == (void*)-1){
+                return NULL;
+            }
+            region_start = region_top = (char*)region;
+            region_end = region_start + SLAB_REGION_SIZE;
+        }
+        if(region_top == region_end){
+            return NULL;
+        }
+        slab = (SlabPage*)region_top;
+        region_top += SLAB_PAGE_SIZE;
+    }
+
+    // Only a page entered for the first time can fail, it is kept for later
+    if(!pageMap.set(slab, SLAB_PAGE_SIZE, PAGE_SLAB, object_size / 8)){
+        slab->next = empty_slabs;
+        empty_slabs = slab;
+        return NULL;
+    }
+    slab->cookie = cookie_code;
+    slab->object_size = object_size;
+    slab->num_slots = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / object_size;
+    slab->num_free = slab->num_slots;
+    for(int i = 0; i < SLAB_MAP_WORDS; i++){
+        int first_slot = i * 64;
+        if(first_slot + 64 <= slab->num_slots){
+            slab->free_map[i] = ~(uint64_t)0;
+        }
+        else if(first_slot < slab->num_slots){
+            slab->free_map[i] = ((uint64_t)1 << (slab->num_slots - first_slot)) - 1;
+        }
+        else{
+            slab->free_map[i] = 0;
+        }
+    }
+
+    num_slabs++;
+    num_slots += slab->num_slots;
+    num_free_slots += slab->num_slots;
+    slot_bytes += slab->num_slots * object_size;
+    free_slot_bytes += slab->num_slots * object_size;
+    return slab;
+}
+
+void* SlabAllocator::allocateObject(size_t size){
+    int size_class = size / 8 - 1;
+    SlabPage* slab = partial_slabs[size_class];
+    if(slab == NULL){
+        slab = NewSlab(size);
+        if(slab == NULL){
+            return NULL;
+        }
+        LinkSlab(slab);
+    }
+
+    int word = 0;
+    while(slab->free_map[word] == 0){
+        word++;
+    }
+    int bit = __builtin_ctzll(slab->free_map[word]);
+    slab->free_map[word] &= ~((uint64_t)1 << bit);
+    slab->num_free--;
+    if(slab->num_free == 0){
+        UnlinkSlab(slab);
+    }
+
+    num_free_slots--;
+    free_slot_bytes -= size;
+    return (char*)slab + SLAB_HEADER_SIZE + (word * 64 + bit) * size;
+}
+
+void SlabAllocator::releaseObject(void* ptr){
+    SlabPage* slab = ptr_to_slab(ptr);
+    size_t offset = (char*)ptr - (char*)slab - SLAB_HEADER_SIZE;
+    if(offset % slab->object_size != 0){
+        return;
+    }
+    size_t slot = offset / slab->object_size;
+    uint64_t mask = (uint64_t)1 << (slot % 64);
+    if(slot >= slab->num_slots || (slab->free_map[slot / 64] & mask)){
+        return;
+    }
+
+    slab->free_map[slot / 64] |= mask;
+    if(slab->num_free == 0){
+        LinkSlab(slab);
+    }
+    slab->num_free++;
+    num_free_slots++;
+    free_slot_bytes += slab->object_size;
+
+    if(slab->num_free == slab->num_slots){
+        // The slab is empty, it is kept for any size class to reuse
+        UnlinkSlab(slab);
+        num_slabs--;
+        num_slots -= slab->num_slots;
+        num_free_slots -= slab->num_slots;
+        slot_bytes -= slab->num_slots * slab->object_size;
+        free_slot_bytes -= slab->num_slots * slab->object_size;
+        slab->next = empty_slabs;
+        empty_slabs = slab;
+    }
+}
+
+size_t SlabAllocator::num_free_blocks() {
+    return num_free_slots;
+}
+
+size_t SlabAllocator::num_free_bytes() {
+    return free_slot_bytes;
+}
+
+size_t SlabAllocator::num_allocated_blocks() {
+    return num_slots;
+}
+
+size_t SlabAllocator::num_allocated_bytes() {
+    return slot_bytes;
+}
+
+size_t SlabAllocator::num_meta_data_bytes() {
+    return num_slabs * SLAB_HEADER_SIZE;
+}
+
+
+////////////////////////////////////////////////////////
+/*
+                    Buddy Allocator                 
+                                                      */
+////////////////////////////////////////////////////////
+
+// Alternative engine for the sbrk heap. Blocks are 128 << order bytes
+// including the header, and live inside max order blocks that are aligned
+// to their size, so a block's buddy is found by flipping one address bit.
+class BuddyAllocator{
+    public:
+        MallocMetadata* free_lists[BUDDY_MAX_ORDER + 1];
+        int cookie_code;
+
+        size_t num_blocks;
+        size_t num_free;
+        size_t alloced_bytes;
+        size_t free_bytes;
+
+        BuddyAllocator();
+        ~BuddyAllocator() = default;
+
+        bool Grow();
+        void* allocateBlock(size_t size);
+        void releaseBlock(void* ptr);
+        void* reallocateBlock(void* ptr, size_t size);
+        static int BlockOrder(MallocMetadata* block);
+        void PushFree(MallocMetadata* block, int order);
+        void PopFree(MallocMetadata* block, int order);
+        void VerifyCookieCode(MallocMetadata* block);
+        MallocMetadata* data_to_meta(void* p);
+
+        size_t num_free_blocks();
+        size_t num_free_bytes();
+        size_t num_allocated_blocks();
+        size_t num_allocated_bytes();
+        size_t num_meta_data_bytes();
+};
+
+BuddyAllocator::BuddyAllocator() : free_lists(), cookie_code(rand() & 0xff),
+                                   num_blocks(0), num_free(0), alloced_bytes(0), free_bytes(0) {}
+
+void BuddyAllocator::VerifyCookieCode(MallocMetadata* block){
+    if(block != NULL && block->cookie != cookie_code){
+        exit(DEADBEEF);
+    }
+}
+
+MallocMetadata* BuddyAllocator::data_to_meta(void* p){
+    MallocMetadata* block = (MallocMetadata*)((char*)p - sizeof(MallocMetadata));
+    VerifyCookieCode(block);
+    return block;
+}
+
+int BuddyAllocator::BlockOrder(MallocMetadata* block){
+    size_t total = (block->size + sizeof(MallocMetadata)) / BUDDY_MIN_BLOCK;
+    return __builtin_ctzl(total);
+}
+
+void BuddyAllocator::PushFree(MallocMetadata* block, int order){
+    block->cookie = cookie_code;
+    block->size = (BUDDY_MIN_BLOCK << order) - sizeof(MallocMetadata);
+    block->is_free = 1;
+    block->prev_free() = NULL;
+    block->next_free() = free_lists[order];
+    if(block->next_free() != NULL){
+        block->next_free()->prev_free() = block;
+    }
+    free_lists[order] = block;
+    num_free++;
+    free_bytes += block->size;
+}
+
+void BuddyAllocator::PopFree(MallocMetadata* block, int order){
+    if(block->prev_free() != NULL){
+        block->prev_free()->next_free() = block->next_free();
+    }
+    else{
+        free_lists[order] = block->next_free();
+    }
+    if(block->next_free() != NULL){
+        block->next_free()->prev_free() = block->prev_free();
+    }
+    block->next_free() = NULL;
+    block->prev_free() = NULL;
+    block->is_free = 0;
+    num_free--;
+    free_bytes -= block->size;
+}
+
+bool BuddyAllocator::Grow(){
+    // Align the break to the max block size, so buddies can be found by
+    // address alone.
+    char* current = (char*)sbrk(0);
+    if(current == (void*)-1){
+        return false;
+    }
+    size_t padding = (BUDDY_MAX_BLOCK - ((unsigned long)current % BUDDY_MAX_BLOCK)) % BUDDY_MAX_BLOCK;
+    char* start = (char*)sbrk(padding + BUDDY_GROW_BLOCKS * BUDDY_MAX_BLOCK);
+    if(start == (void*)-1){
+        return false;
+    }
+    start += padding;
+    char* end = start + BUDDY_GROW_BLOCKS * BUDDY_MAX_BLOCK;
+    if(!pageMap.set(start, end - start, PAGE_BUDDY)){
+        return false;
+    }
+
+    for(char* block = start; block < end; block += BUDDY_MAX_BLOCK){
+        PushFree((MallocMetadata*)block, BUDDY_MAX_ORDER);
+        num_blocks++;
+    }
+    return true;
+}
+
+void* BuddyAllocator::allocateBlock(size_t size){
+    int wanted = 0;
+    while((BUDDY_MIN_BLOCK << wanted) - sizeof(MallocMetadata) < size){
+        wanted++;
+    }
+
+    int order = wanted;
+    while(order <= BUDDY_MAX_ORDER && free_lists[order] == NULL){
+        order++;
+    }
+    if(order > BUDDY_MAX_ORDER){
+        if(!Grow()){
+            return NULL;
+        }
+        order = BUDDY_MAX_ORDER;
+    }
+
+    MallocMetadata* block = free_lists[order];
+    VerifyCookieCode(block);
+    PopFree(block, order);
+    while(order > wanted){
+        order--;
+        PushFree((MallocMetadata*)((char*)block + (BUDDY_MIN_BLOCK << order)), order);
+        num_blocks++;
+    }
+
+    block->size = (BUDDY_MIN_BLOCK << wanted) - sizeof(MallocMetadata);
+    alloced_bytes += block->size;
+    return (char*)block + sizeof(MallocMetadata);
+}
+
+void BuddyAllocator::releaseBlock(void* ptr){
+    MallocMetadata* block = data_to_meta(ptr);
+    if(block->is_free){
+        return;
+    }
+    int order = BlockOrder(block);
+    alloced_bytes -= block->size;
+
+    while(order < BUDDY_MAX_ORDER){
+        MallocMetadata* buddy = (MallocMetadata*)((unsigned long)block ^ (BUDDY_MIN_BLOCK << order));
+        VerifyCookieCode(buddy);
+        if(!buddy->is_free || BlockOrder(buddy) != order){
+            break;
+        }
+        PopFree(buddy, order);
+        num_blocks--;
+        if(buddy < block){
+            block = buddy;
+        }
+        order++;
+    }
+    PushFree(block, order);
+}
+
+void* BuddyAllocator::reallocateBlock(void* ptr, size_t size){
+    MallocMetadata* block = data_to_meta(ptr);
+    if(block->size >= size){
+        return ptr;
+    }
+
+    void* new_block = smalloc(size);
+    if(new_block == NULL){
+        return NULL;
+    }
+    copyMemory(new_block, ptr, block->size);
+    releaseBlock(ptr);
+    return new_block;
+}
+
+size_t BuddyAllocator::num_free_blocks() {
+    return num_free;
+}
+
+size_t BuddyAllocator::num_free_bytes() {
+    return free_bytes;
+}
+
+size_t BuddyAllocator::num_allocated_blocks() {
+    return num_blocks;
+}
+
+size_t BuddyAllocator::num_allocated_bytes() {
+    return alloced_bytes + free_bytes;
+}
+
+size_t BuddyAllocator::num_meta_data_bytes() {
+    return num_blocks * sizeof(MallocMetadata);
+}
+
+
+AllocedBlocksList allocatedBlocks = AllocedBlocksList();
+SlabAllocator slabAllocator = SlabAllocator();
+BuddyAllocator buddyAllocator = BuddyAllocator();
+
+// Guards the slab and buddy engines and the list of thread caches. Arenas
+// have a lock of their own, and heap_lock is always taken first.
+pthread_mutex_t heap_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+class LockGuard{
+public:
+    pthread_mutex_t* lock;
+    LockGuard(pthread_mutex_t* lock) : lock(lock) { pthread_mutex_lock(lock); }
+    ~LockGuard() { pthread_mutex_unlock(lock); }
+};
+
+
+////////////////////////////////////////////////////////
+/*
+                    Arenas                 
+                                                      */
+////////////////////////////////////////////////////////
+
+std::atomic<AllocedBlocksList*> arenas[ARENA_MAX] = { {&allocatedBlocks} };
+pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+std::atomic<unsigned int> next_arena(0);
+thread_local int thread_arena = -1;
+
+int arenaCount(){
+    static int count = 0;
+    if(count == 0){
+        long cpus = ARENA_COUNT > 0 ? ARENA_COUNT : sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus < 1 ? 1 : (cpus > ARENA_MAX ? ARENA_MAX : (int)cpus);
+    }
+    return count;
+}
+
+// Returns the arena, creating it on first use. Falls back to the main arena
+// if its region can't be mapped.
+AllocedBlocksList* getArena(int index){
+    AllocedBlocksList* arena = arenas[index].load(std::memory_order_acquire);
+    if(arena != nullptr){
+        return arena;
+    }
+
+    LockGuard guard(&arenas_lock);
+    arena = arenas[index].load(std::memory_order_relaxed);
+    if(arena == nullptr){
+        void* memory = mmap(NULL, sizeof(AllocedBlocksList), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == (void*)-1){
+            return &allocatedBlocks;
+        }
+        arena = new (memory) AllocedBlocksList(/*use_sbrk=*/false, index);
+        arenas[index].store(arena, std::memory_order_release);
+    }
+    return arena;
+}
+
+// Returns the calling thread's arena, locked. Threads start on arenas in
+// round-robin order, and a thread that finds its arena busy moves to the
+// first one that isn't.
+AllocedBlocksList* acquireArena(){
+    int count = arenaCount();
+    if(thread_arena < 0){
+        thread_arena = next_arena.fetch_add(1, std::memory_order_relaxed) % count;
+    }
+
+    AllocedBlocksList* arena = getArena(thread_arena);
+    if(pthread_mutex_trylock(&arena->lock) == 0){
+        return arena;
+    }
+    for(int i = 1; i < count; i++){
+        int index = (thread_arena + i) % count;
+        AllocedBlocksList* other = getArena(index);
+        if(pthread_mutex_trylock(&other->lock) == 0){
+            thread_arena = index;
+            return other;
+        }
+    }
+    pthread_mutex_lock(&arena->lock);
+    return arena;
+}
+
+// The page map entry of a heap page or an mmapped block names its arena.
+// Anything else wasn't handed out by an arena.
+AllocedBlocksList* arenaOf(uint16_t entry){
+    AllocedBlocksList* arena = nullptr;
+    if(pageTier(entry) == PAGE_HEAP || pageTier(entry) == PAGE_MMAP){
+        arena = arenas[pageOwner(entry)].load(std::memory_order_acquire);
+    }
+    if(arena == nullptr){
+        exit(DEADBEEF);
+    }
+    return arena;
+}
+
+size_t arenasSum(size_t (AllocedBlocksList::*stat)()){
+    size_t sum = 0;
+    for(int i = 0; i < ARENA_MAX; i++){
+        AllocedBlocksList* arena = arenas[i].load(std::memory_order_acquire);
+        if(arena != nullptr){
+            LockGuard guard(&arena->lock);
+            arena->DrainRemoteFrees();
+            sum += (arena->*stat)();
+        }
+    }
+    return sum;
+}
+
+// Serves a request from the engine its size belongs to, zeroed for scalloc.
+void* heapAllocate(size_t size, int is_scalloc){
+    size_t aligned_size = size;
+    ALIGN_SIZE(aligned_size);
+
+    if (USE_SLAB_ALLOCATOR && size < LARGE_BLOCK && aligned_size <= SLAB_MAX_SIZE) {
+        LockGuard guard(&heap_lock);
+        void* object = slabAllocator.allocateObject(aligned_size);
+        if (object != NULL) {
+            if (is_scalloc) {
+                std::memset(object, 0, size);
+            }
+            return object;
+        }
+        // The slab region is used up, the heap below still has room
+    }
+    if (USE_BUDDY_ALLOCATOR) {
+        LockGuard guard(&heap_lock);
+        if (size < LARGE_BLOCK && aligned_size <= BUDDY_MAX_PAYLOAD) {
+            void* block = buddyAllocator.allocateBlock(aligned_size);
+            if (is_scalloc && block != NULL) {
+                std::memset(block, 0, size);
+            }
+            return block;
+        }
+        LockGuard arena_guard(&allocatedBlocks.lock);
+        return allocatedBlocks.handOutBlock(allocatedBlocks.insertLargeBlock(size, is_scalloc), size, is_scalloc);
+    }
+
+    AllocedBlocksList* arena = acquireArena();
+    void* new_block = arena->allocateBlock(size, is_scalloc);
+    pthread_mutex_unlock(&arena->lock);
+    return new_block;
+}
+
+void heapRelease(void* p){
+    uint16_t entry = pageMap.lookup(p);
+    if(pageTier(entry) == PAGE_SLAB){
+        LockGuard guard(&heap_lock);
+        slabAllocator.releaseObject(p);
+        return;
+    }
+    if(pageTier(entry) == PAGE_BUDDY){
+        LockGuard guard(&heap_lock);
+        buddyAllocator.releaseBlock(p);
+        return;
+    }
+    AllocedBlocksList* arena = arenaOf(entry);
+    if(pageTier(entry) == PAGE_HEAP && arena->arena_id != thread_arena){
+        // Left for the owner to merge on its next allocation. A thread that
+        // never allocated has no arena and always ends up here, which keeps
+        // a thread that only frees what others allocate off their locks.
+        // The owner may be rewriting the flags, so only the released byte
+        // and the payload are written, and a block that is released already
+        // was freed twice.
+        MallocMetadata* meta_data_ptr = (MallocMetadata*)p - 1;
+        MallocMetadata flags = meta_data_ptr->loadFlags();
+        arena->VerifyCookieCode(&flags);
+        if(!meta_data_ptr->markReleased()){
+            return;
+        }
+        arena->PushRemoteFree(meta_data_ptr);
+        return;
     }
+    LockGuard guard(&arena->lock);
+    arena->releaseBlock(p);
 }
 
-void AllocedBlocksList::releaseRegularBlock(void* ptr){
-    MallocMetadata* meta_data_ptr = data_to_meta(ptr);
-    if(meta_data_ptr->is_free){
-        return;
+// Only reads the block's own header, in one load, so it needs no lock.
+size_t heapUsableSize(void* p){
+    uint16_t entry = pageMap.lookup(p);
+    if(pageTier(entry) == PAGE_SLAB){
+        return pageOwner(entry) * 8;
     }
-    meta_data_ptr->is_free = 1;
-
-    MallocMetadata* next_free = this->GetNextIfFree(meta_data_ptr);
-    MallocMetadata* prev_free = this->GetPrevIfFree(meta_data_ptr);
-    
-    if(next_free != NULL ||  prev_free != NULL){
-        this->UnionAndInsert(meta_data_ptr, next_free, prev_free);
+    if(pageTier(entry) == PAGE_BUDDY){
+        return buddyAllocator.data_to_meta(p)->size;
     }
+    MallocMetadata flags = ((MallocMetadata*)p - 1)->loadFlags();
+    arenaOf(entry)->VerifyCookieCode(&flags);
+    return flags.size;
 }
 
-void AllocedBlocksList::RemoveBlock(MallocMetadata* block) {
-    VerifyCookieCode(block);
-    if (block->prev == NULL) {
-        head = block->next;
-        if(block->next != NULL){
-        head->prev = NULL;
-        }
 
-    } else {
-        VerifyCookieCode(block->prev);
-        VerifyCookieCode(block->next);
-        block->prev->next = block->next;
-        if(block->next!=NULL){
-            block->next->prev = block->prev;
-        }
-    }
+////////////////////////////////////////////////////////
+/*
+                    Central Free Lists                 
+                                                      */
+////////////////////////////////////////////////////////
 
-    block->next = NULL;
-    block->prev = NULL;
-}
+// Shared pool per cache bin that the thread and CPU caches refill from and
+// flush to before going to the heap. It is a Treiber stack linked through
+// the payload; the top pointer carries a tag in its unused high 16 bits that
+// changes on every update, so a pop can't succeed on a stale top (ABA).
+// Cached blocks are never unmapped, so reading a stale link is harmless.
+class CentralFreeList{
+public:
+    std::atomic<uint64_t> top;
+    std::atomic<size_t> count;
 
+    CentralFreeList() : top(0), count(0) {}
 
-void* AllocedBlocksList::SplitAndInsert(size_t new_size, MallocMetadata* old_block) {
-    VerifyCookieCode(old_block);
-    RemoveBlock(old_block);
-    void* free_block = insertBlock(old_block->size - new_size - size_meta_data(), (MallocMetadata*)((char*)old_block + new_size + size_meta_data()));
-    if (old_block == wilderness_block) {
-        wilderness_block = data_to_meta(free_block);
+    static void* Pointer(uint64_t value) { return (void*)(uintptr_t)(value & ((1ULL << 48) - 1)); }
+    static uint64_t Pack(void* ptr, uint64_t old) { return (uintptr_t)ptr | ((old >> 48) + 1) << 48; }
+
+    bool Push(void* ptr);
+    void* Pop();
+};
+
+CentralFreeList central_lists[TCACHE_NUM_BINS];
+std::atomic<size_t> central_bytes(0);
+
+// Returns false when the list already holds CENTRAL_MAX_BLOCKS blocks.
+bool CentralFreeList::Push(void* ptr){
+    if(count.fetch_add(1, std::memory_order_relaxed) >= CENTRAL_MAX_BLOCKS){
+        count.fetch_sub(1, std::memory_order_relaxed);
+        return false;
     }
-    data_to_meta(free_block)->is_free = 1;
+    central_bytes.fetch_add(heapUsableSize(ptr), std::memory_order_relaxed);
+    uint64_t old_top = top.load(std::memory_order_relaxed);
+    do {
+        *(void**)ptr = Pointer(old_top);
+    } while(!top.compare_exchange_weak(old_top, Pack(ptr, old_top), std::memory_order_release, std::memory_order_relaxed));
+    return true;
+}
 
-    // Don't merge after split
-    // MallocMetadata* next_free = GetNextIfFree(data_to_meta(free_block));
-    // if(next_free != NULL){
-    //     UnionAndInsert(data_to_meta(free_block), next_free, NULL);
-    // }
-    insertBlock(new_size, old_block);
-    return meta_to_data(old_block);
+void* CentralFreeList::Pop(){
+    uint64_t old_top = top.load(std::memory_order_acquire);
+    void* ptr;
+    do {
+        ptr = Pointer(old_top);
+        if(ptr == nullptr){
+            return NULL;
+        }
+    } while(!top.compare_exchange_weak(old_top, Pack(__atomic_load_n((void**)ptr, __ATOMIC_RELAXED), old_top),
+                                       std::memory_order_acquire, std::memory_order_acquire));
+    count.fetch_sub(1, std::memory_order_relaxed);
+    central_bytes.fetch_sub(heapUsableSize(ptr), std::memory_order_relaxed);
+    return ptr;
 }
 
-void* AllocedBlocksList::insertLargeBlock(size_t size, int is_scalloc) {
-    MallocMetadata* new_large_block;
-    if ((!is_scalloc && size >= HUGE_SIZE_MALLOC) || (is_scalloc && size >= HUGE_SIZE_SCALLOC)) {
-        new_large_block = (MallocMetadata*)mmap(NULL ,sizeof(*new_large_block) + size, PROT_READ | PROT_WRITE, MAP_HUGETLB | MAP_PRIVATE | MAP_ANONYMOUS , -1, 0);
-    }
-    else {
-        new_large_block = (MallocMetadata*)mmap(NULL ,sizeof(*new_large_block) + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS , -1, 0);
-    }
 
-    if (new_large_block == (void*)-1){
-        return NULL;
-    }
-    VerifyCookieCode(head_large);
+////////////////////////////////////////////////////////
+/*
+                    Thread Cache                 
+                                                      */
+////////////////////////////////////////////////////////
 
-    new_large_block->cookie = this->cookie_code;
-    new_large_block->is_free = 0;
-    new_large_block->size = size;
-    new_large_block->next = NULL;
-    new_large_block->prev = NULL;
+// Recently freed small blocks are kept per thread and per size, so an
+// smalloc/sfree pair of the same size never takes heap_lock. The heap still
+// sees cached blocks as allocated, the statistics report them as free.
+class ThreadCache{
+public:
+    void* bins[TCACHE_NUM_BINS];
+    unsigned int counts[TCACHE_NUM_BINS];
+    std::atomic<size_t> cached_blocks;
+    std::atomic<size_t> cached_bytes;
+    bool registered;
+    ThreadCache* next;
+    ThreadCache* prev;
+
+    ThreadCache() : bins(), counts(), cached_blocks(0), cached_bytes(0), registered(false), next(nullptr), prev(nullptr) {}
+    ~ThreadCache();
+
+    void* allocateBlock(size_t size);
+    bool releaseBlock(void* ptr);
+    void Push(int bin, void* ptr, size_t size);
+    void* Pop(int bin);
+    void Refill(int bin, size_t size);
+    void Flush(int bin, unsigned int count);
+    void Register();
+};
 
-    if (head_large == NULL) {
-        head_large = new_large_block;
-        return meta_to_data(head_large);
+// Every thread cache that holds blocks, guarded by heap_lock.
+ThreadCache* thread_caches = nullptr;
+thread_local ThreadCache threadCache;
+
+ThreadCache::~ThreadCache(){
+    if(!registered){
+        return;
     }
- 
-    MallocMetadata* temp = head_large;
-    while (temp->next != NULL) {
-        VerifyCookieCode(temp);
-        temp = temp->next;
+    for(int bin = 0; bin < TCACHE_NUM_BINS; bin++){
+        Flush(bin, counts[bin]);
+    }
+    LockGuard guard(&heap_lock);
+    if(prev != nullptr){
+        prev->next = next;
+    }
+    else{
+        thread_caches = next;
+    }
+    if(next != nullptr){
+        next->prev = prev;
     }
-    
-    new_large_block->prev = temp;
-    temp->next = new_large_block;
-    return meta_to_data(new_large_block);
 }
 
-void AllocedBlocksList::releaseLargeBlock(void* ptr){
-    MallocMetadata* meta_data_ptr = data_to_meta(ptr);
-    VerifyCookieCode(head_large);
-
-    if (meta_data_ptr->prev == NULL) {
-        head_large = meta_data_ptr->next;
-        if(meta_data_ptr->next != NULL){
-        head_large->prev = NULL;
-        }
-
-    } else { 
-        VerifyCookieCode(meta_data_ptr->next);
-        VerifyCookieCode(meta_data_ptr->prev);
-        meta_data_ptr->prev->next = meta_data_ptr->next;
-        if(meta_data_ptr->next!=NULL){
-            meta_data_ptr->next->prev = meta_data_ptr->prev;
-        }
+void ThreadCache::Register(){
+    LockGuard guard(&heap_lock);
+    next = thread_caches;
+    if(next != nullptr){
+        next->prev = this;
     }
+    thread_caches = this;
+    registered = true;
+}
 
-    meta_data_ptr->next = NULL;
-    meta_data_ptr->prev = NULL;
+void ThreadCache::Push(int bin, void* ptr, size_t size){
+    *(void**)ptr = bins[bin];
+    bins[bin] = ptr;
+    counts[bin]++;
+    cached_blocks.store(cached_blocks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    cached_bytes.store(cached_bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+}
 
-    munmap(meta_data_ptr, meta_data_ptr->size + size_meta_data());
+void* ThreadCache::Pop(int bin){
+    void* ptr = bins[bin];
+    bins[bin] = *(void**)ptr;
+    counts[bin]--;
+    cached_blocks.store(cached_blocks.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    cached_bytes.store(cached_bytes.load(std::memory_order_relaxed) - heapUsableSize(ptr), std::memory_order_relaxed);
+    return ptr;
 }
 
-void* AllocedBlocksList::ReallocateRegularBlock(MallocMetadata* block, size_t size){
-    if(block->size >= size){ // 1.a
-        if(block->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
-            SplitAndInsert(size, block);
+void ThreadCache::Flush(int bin, unsigned int count){
+    while(count-- > 0 && bins[bin] != nullptr){
+        void* ptr = Pop(bin);
+        if(!central_lists[bin].Push(ptr)){
+            heapRelease(ptr);
         }
-        return meta_to_data(block);
     }
+}
 
-    MallocMetadata* next = GetNextIfFree(block);
-    MallocMetadata* prev = GetPrevIfFree(block);
-
-    if(prev != NULL){ // 1.b
-        if(block->size + prev->size + size_meta_data() >= size){ // 1.b no wilderness
-            RemoveBlock(block);
-            RemoveBlock(prev);
-            insertBlock(block->size + prev->size + size_meta_data(), prev);
-            if(block == wilderness_block){
-                wilderness_block = prev;
-            }
-            if(prev->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
-                SplitAndInsert(size, prev);
-                // After splitting, we check if we need to update the wilderness_block (that we change to prev in the last if)
-                if(prev == wilderness_block){
-                    wilderness_block = (MallocMetadata*)((char*)prev + size_meta_data() + size);
-                }
-            }
-            memmove(meta_to_data(prev), meta_to_data(block), block->size);
-            return meta_to_data(prev);
-        }
-        else if(block == wilderness_block){ // 1.b with wilderness
-            RemoveBlock(block);
-            RemoveBlock(prev);
-            insertBlock(block->size + prev->size + size_meta_data(), prev);
-            wilderness_block = prev;
-            sbrk(size - wilderness_block->size);
-            wilderness_block->size += size - wilderness_block->size;
-            memmove(meta_to_data(prev), meta_to_data(block), block->size);
-            return meta_to_data(prev);
+void ThreadCache::Refill(int bin, size_t size){
+    if(!registered){
+        Register();
+    }
+    for(int i = 0; i < TCACHE_BATCH; i++){
+        void* ptr = central_lists[bin].Pop();
+        if(ptr == NULL){
+            break;
         }
+        Push(bin, ptr, heapUsableSize(ptr));
     }
-    else if(block == wilderness_block){  // 1.c
-        sbrk(size - wilderness_block->size);
-        wilderness_block->size += size - wilderness_block->size;
-        return meta_to_data(wilderness_block);
+    if(bins[bin] != nullptr){
+        return;
     }
 
-    if(next != NULL){ // 1.d
-        if(block->size + next->size + size_meta_data() >= size){
-            RemoveBlock(block);
-            RemoveBlock(next);
-            insertBlock(block->size + next->size + size_meta_data(), block);
-            if(next == wilderness_block){
-                wilderness_block = block;
-            }
-            if(block->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
-                SplitAndInsert(size, block);
-                // After splitting, we check if we need to update the wilderness_block (that we change to prev in the last if)
-                if(block == wilderness_block){
-                    wilderness_block = (MallocMetadata*)((char*)block + size_meta_data() + size);
-                }
-            }
-            return meta_to_data(block);
+    // Keep the arena locked for the whole batch when it serves this size,
+    // heapAllocate re-enters it
+    bool from_arena = !USE_BUDDY_ALLOCATOR && !(USE_SLAB_ALLOCATOR && size <= SLAB_MAX_SIZE);
+    AllocedBlocksList* arena = from_arena ? acquireArena() : nullptr;
+    for(int i = 0; i < TCACHE_BATCH; i++){
+        void* ptr = heapAllocate(size, 0);
+        if(ptr == NULL){
+            break;
         }
+        Push(bin, ptr, heapUsableSize(ptr));
     }
-
-    if(prev != NULL && next != NULL){ // 1.e
-        if(block->size + prev->size + next->size + 2*size_meta_data() >= size){
-            UnionAndInsert(block, next, prev, 0);
-            memmove(meta_to_data(prev), meta_to_data(block), block->size);
-            if(prev->size - size >= (MIN_SPLIT_SIZE + size_meta_data())){
-                SplitAndInsert(size, prev);
-                // After splitting, we check if we need to update the wilderness_block (that we change to prev in the last if)
-                if(prev == wilderness_block){
-                    wilderness_block = (MallocMetadata*)((char*)prev + size_meta_data() + size);
-                }
-            }
-            return meta_to_data(prev);
-        }
+    if(arena != nullptr){
+        pthread_mutex_unlock(&arena->lock);
     }
-    
-    if(next != NULL && next == wilderness_block){ // 1.f
-        if(prev != NULL){ // 1.f1
-            UnionAndInsert(block, next, prev, 0);
-            memmove(meta_to_data(prev), meta_to_data(block), block->size);
-
-            wilderness_block = prev;
-            sbrk(size - wilderness_block->size);
-            wilderness_block->size += size - wilderness_block->size;
-            return meta_to_data(wilderness_block);
-        }
-        else{ // 1.f2
-            UnionAndInsert(block, next, NULL, 0);
+}
 
-            wilderness_block = block;
-            sbrk(size - wilderness_block->size);
-            wilderness_block->size += size - wilderness_block->size;
-            return meta_to_data(wilderness_block);
+void* ThreadCache::allocateBlock(size_t size){
+    ALIGN_SIZE(size);
+    if(size > TCACHE_MAX_SIZE){
+        return NULL;
+    }
+    int bin = size / 8 - 1;
+    if(bins[bin] == nullptr){
+        Refill(bin, size);
+        if(bins[bin] == nullptr){
+            return NULL;
         }
     }
+    return Pop(bin);
+}
 
-    void* new_block = smalloc(size); // g + h
-    if(new_block == NULL){
-        return NULL;
+bool ThreadCache::releaseBlock(void* ptr){
+    size_t size = heapUsableSize(ptr);
+    if(size > TCACHE_MAX_SIZE){
+        return false;
+    }
+    if(!registered){
+        Register();
+    }
+    int bin = size / 8 - 1;
+    if(counts[bin] >= TCACHE_BIN_COUNT){
+        Flush(bin, TCACHE_BATCH);
     }
+    Push(bin, ptr, size);
+    return true;
+}
 
-    memmove(new_block, meta_to_data(block), block->size);
-    sfree(meta_to_data(block));
 
-    return new_block;
-}
 
+////////////////////////////////////////////////////////
+/*
+                    CPU Cache                 
+                                                      */
+////////////////////////////////////////////////////////
 
-void* AllocedBlocksList::ReallocateLargeBlock(MallocMetadata* oldblock, size_t size){
-    VerifyCookieCode(oldblock);
-    if(oldblock->size == size){
-        return meta_to_data(oldblock);
-    }
+// The caches in front of the heap per CPU. Every bin is an array and the
+// number of blocks in it, so a push or a pop is committed by the one store
+// to that count. With rseq the store ends a restartable sequence: a thread
+// preempted or migrated before it starts over on the CPU it is on now, and
+// the fast path takes no atomic at all. Without rseq a thread claims the
+// cache of its CPU with a flag that is only ever contended after such a
+// migration, and goes straight to the heap if it finds it taken.
+class alignas(64) CpuCache{
+public:
+    unsigned long counts[TCACHE_NUM_BINS];
+    void* slots[TCACHE_NUM_BINS][TCACHE_BIN_COUNT];
+    std::atomic<bool> busy;
 
-    void* new_block = insertLargeBlock(size);
-    if(new_block == NULL){
-        return NULL;
+    CpuCache() : counts(), slots(), busy(false) {}
+};
+
+CpuCache cpu_caches[CPU_CACHE_MAX];
+
+// The calling thread's rseq area, NULL if the kernel doesn't update it.
+struct rseq* rseqArea(){
+#if HAVE_RSEQ
+    if(__rseq_size > 0){
+        struct rseq* area = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+        if((int)__atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED) >= 0){
+            return area;
+        }
     }
+#endif
+    return NULL;
+}
 
-    memmove(new_block, oldblock, size);
-    releaseLargeBlock(meta_to_data(oldblock));
+// The kernel keeps the current CPU in the thread's rseq area, which is
+// cheaper to read than calling sched_getcpu.
+int currentCpu(){
+#if HAVE_RSEQ
+    struct rseq* area = rseqArea();
+    if(area != NULL){
+        return (int)__atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED);
+    }
+#endif
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu;
+}
 
-    return new_block;
+// Decided once for the whole process, as a cache must never be updated by
+// a sequence and under the flag at the same time. The sequences index the
+// caches by the CPU number as it is, so every CPU needs one of its own.
+bool cpuCachesUseRseq(){
+    static const bool use_rseq = HAVE_RSEQ_CS && rseqArea() != NULL && sysconf(_SC_NPROCESSORS_CONF) <= CPU_CACHE_MAX;
+    return use_rseq;
 }
 
-size_t AllocedBlocksList::num_free_blocks() {
-    size_t free_blocks = 0;
+#if HAVE_RSEQ_CS
+// Both sequences run from 1 to the store of the new count, which is the
+// last instruction before 2. The kernel sends a thread it preempts or
+// migrates in between to 4, which starts over from 0 with the descriptor
+// registered again. The abort handler is preceded by the signature glibc
+// registered the area with.
+#define RSEQ_CRITICAL_SECTION                                                  \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                      \
+    ".balign 32\n\t"                                                           \
+    "3:\n\t"                                                                   \
+    ".long 0, 0\n\t"                                                           \
+    ".quad 1f, 2f - 1f, 4f\n\t"                                                \
+    ".popsection\n\t"                                                         \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                                 \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                               \
+    ".long %c[sig]\n\t"                                                        \
+    "4:\n\t"                                                                   \
+    "jmp 0f\n\t"                                                               \
+    ".popsection\n\t"                                                         \
+    "0:\n\t"                                                                   \
+    "leaq 3b(%%rip), %%rax\n\t"                                                \
+    "movq %%rax, %[rseq_cs]\n\t"                                               \
+    "1:\n\t"                                                                   \
+    "movl %[cpu], %%eax\n\t"                                                   \
+    "imulq %[cache_size], %%rax\n\t"
+
+// Pushes ptr on bin of the current CPU's cache, false if the bin is full.
+bool rseqPush(struct rseq* area, int bin, void* ptr){
+    unsigned long pushed = 0;
+    __asm__ __volatile__(
+        RSEQ_CRITICAL_SECTION
+        "movq (%[count], %%rax), %%rcx\n\t"
+        "cmpq %[capacity], %%rcx\n\t"
+        "jae 5f\n\t"
+        "leaq (%[slots], %%rax), %%rdx\n\t"
+        "movq %[ptr], (%%rdx, %%rcx, 8)\n\t"
+        "addq $1, %%rcx\n\t"
+        "movq %%rcx, (%[count], %%rax)\n\t"
+        "2:\n\t"
+        "movq $1, %[pushed]\n\t"
+        "5:\n\t"
+        : [pushed] "+r"(pushed), [rseq_cs] "=m"(area->rseq_cs)
+        : [cpu] "m"(area->cpu_id_start), [count] "r"(&cpu_caches[0].counts[bin]),
+          [slots] "r"(&cpu_caches[0].slots[bin][0]), [ptr] "r"(ptr),
+          [cache_size] "i"(sizeof(CpuCache)), [capacity] "i"(TCACHE_BIN_COUNT), [sig] "i"(RSEQ_SIG)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return pushed;
+}
 
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        if(temp->is_free == 1) {
-            free_blocks++;
-        }
-        temp = temp->next;
+// Pops the last block pushed on bin of the current CPU's cache, NULL if
+// the bin is empty.
+void* rseqPop(struct rseq* area, int bin){
+    void* ptr = NULL;
+    __asm__ __volatile__(
+        RSEQ_CRITICAL_SECTION
+        "movq (%[count], %%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz 5f\n\t"
+        "leaq (%[slots], %%rax), %%rdx\n\t"
+        "movq -8(%%rdx, %%rcx, 8), %%rdx\n\t"
+        "subq $1, %%rcx\n\t"
+        "movq %%rcx, (%[count], %%rax)\n\t"
+        "2:\n\t"
+        "movq %%rdx, %[ptr]\n\t"
+        "5:\n\t"
+        : [ptr] "+r"(ptr), [rseq_cs] "=m"(area->rseq_cs)
+        : [cpu] "m"(area->cpu_id_start), [count] "r"(&cpu_caches[0].counts[bin]),
+          [slots] "r"(&cpu_caches[0].slots[bin][0]),
+          [cache_size] "i"(sizeof(CpuCache)), [sig] "i"(RSEQ_SIG)
+        : "rax", "rcx", "rdx", "memory", "cc");
+    return ptr;
+}
+#endif
+
+// With rseq, a thread whose area the kernel doesn't update goes to the heap.
+bool cpuCachePush(int bin, void* ptr){
+#if HAVE_RSEQ_CS
+    if(cpuCachesUseRseq()){
+        struct rseq* area = rseqArea();
+        return area != NULL && rseqPush(area, bin, ptr);
+    }
+#endif
+    CpuCache* cache = &cpu_caches[currentCpu() % CPU_CACHE_MAX];
+    if(cache->busy.exchange(true, std::memory_order_acquire)){
+        return false;
     }
-    return free_blocks;
+    unsigned long count = cache->counts[bin];
+    if(count < TCACHE_BIN_COUNT){
+        cache->slots[bin][count] = ptr;
+        __atomic_store_n(&cache->counts[bin], count + 1, __ATOMIC_RELAXED);
+    }
+    cache->busy.store(false, std::memory_order_release);
+    return count < TCACHE_BIN_COUNT;
 }
 
-size_t AllocedBlocksList::num_free_bytes() {
-    size_t free_bytes = 0;
+void* cpuCachePop(int bin){
+#if HAVE_RSEQ_CS
+    if(cpuCachesUseRseq()){
+        struct rseq* area = rseqArea();
+        return area != NULL ? rseqPop(area, bin) : NULL;
+    }
+#endif
+    CpuCache* cache = &cpu_caches[currentCpu() % CPU_CACHE_MAX];
+    if(cache->busy.exchange(true, std::memory_order_acquire)){
+        return NULL;
+    }
+    void* ptr = NULL;
+    unsigned long count = cache->counts[bin];
+    if(count > 0){
+        ptr = cache->slots[bin][count - 1];
+        __atomic_store_n(&cache->counts[bin], count - 1, __ATOMIC_RELAXED);
+    }
+    cache->busy.store(false, std::memory_order_release);
+    return ptr;
+}
 
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        if(temp->is_free == 1) {
-            free_bytes += temp->size;
+// The usable size the heap gives a fresh block for a request of size. Every
+// block in a CPU cache bin has exactly the bin's size, which is what lets
+// the statistics count cached bytes from the bins' counts.
+size_t heapBlockSize(size_t size){
+    ALIGN_SIZE(size);
+    if(USE_SLAB_ALLOCATOR && size <= SLAB_MAX_SIZE){
+        return size;
+    }
+    if(USE_BUDDY_ALLOCATOR && size <= BUDDY_MAX_PAYLOAD){
+        size_t block = BUDDY_MIN_BLOCK;
+        while(block - sizeof(MallocMetadata) < size){
+            block <<= 1;
         }
-        temp = temp->next;
+        return block - sizeof(MallocMetadata);
     }
-    return free_bytes;
+    return size < FREE_LINKS_SIZE ? FREE_LINKS_SIZE : size;
 }
 
-size_t AllocedBlocksList::num_allocated_blocks() {
-    size_t alloced_blocks = 0;
+bool cpuCacheRelease(void* p);
 
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        alloced_blocks++;
-        temp = temp->next;
+// Takes a batch from the central list, or from the heap when it is empty,
+// and caches all of it but the block returned.
+void* cpuCacheRefill(int bin, size_t size){
+    void* batch[TCACHE_BATCH];
+    int count = 0;
+    while(count < TCACHE_BATCH && (batch[count] = central_lists[bin].Pop()) != NULL){
+        count++;
     }
-
-    temp = this->head_large;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        alloced_blocks++;
-        temp = temp->next;
+    if(count == 0){
+        // Keep the arena locked for the whole batch when it serves this
+        // size, heapAllocate re-enters it
+        bool from_arena = !USE_BUDDY_ALLOCATOR && !(USE_SLAB_ALLOCATOR && size <= SLAB_MAX_SIZE);
+        AllocedBlocksList* arena = from_arena ? acquireArena() : nullptr;
+        while(count < TCACHE_BATCH && (batch[count] = heapAllocate(size, 0)) != NULL){
+            count++;
+        }
+        if(arena != nullptr){
+            pthread_mutex_unlock(&arena->lock);
+        }
     }
-    
-    return alloced_blocks;
+    if(count == 0){
+        return NULL;
+    }
+    // The heap may hand out a larger block than asked for, which goes in
+    // the bin of its own size
+    for(int i = 1; i < count; i++){
+        if(!cpuCacheRelease(batch[i])){
+            heapRelease(batch[i]);
+        }
+    }
+    return batch[0];
 }
 
-size_t AllocedBlocksList::num_allocated_bytes() {
-    size_t alloced_bytes = 0;
-
-    MallocMetadata* temp = this->head;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        alloced_bytes += temp->size;
-        temp = temp->next;
+void* cpuCacheAllocate(size_t size){
+    size = heapBlockSize(size);
+    if(size > TCACHE_MAX_SIZE){
+        return NULL;
     }
-
-    temp = this->head_large;
-    while (temp != NULL) {
-        VerifyCookieCode(temp);
-        alloced_bytes += temp->size;
-        temp = temp->next;
+    int bin = size / 8 - 1;
+    void* cached = cpuCachePop(bin);
+    if(cached != NULL){
+        return cached;
     }
-
-    return alloced_bytes;
+    return cpuCacheRefill(bin, size);
 }
 
-size_t AllocedBlocksList::num_meta_data_bytes() {
-    return num_allocated_blocks() * size_meta_data();
+// A full bin hands a batch over to the central list to make room.
+bool cpuCacheRelease(void* p){
+    size_t size = heapUsableSize(p);
+    if(size > TCACHE_MAX_SIZE){
+        return false;
+    }
+    int bin = size / 8 - 1;
+    if(cpuCachePush(bin, p)){
+        return true;
+    }
+    for(int i = 0; i < TCACHE_BATCH; i++){
+        void* ptr = cpuCachePop(bin);
+        if(ptr == NULL){
+            break;
+        }
+        if(!central_lists[bin].Push(ptr)){
+            heapRelease(ptr);
+        }
+    }
+    return cpuCachePush(bin, p);
 }
 
-size_t AllocedBlocksList::size_meta_data() {
-    return sizeof(MallocMetadata);
+// Every block in a bin has the bin's size, so the counts are all it takes.
+size_t cpuCacheSum(bool bytes){
+    size_t sum = 0;
+    for(int cpu = 0; cpu < CPU_CACHE_MAX; cpu++){
+        for(int bin = 0; bin < TCACHE_NUM_BINS; bin++){
+            size_t count = __atomic_load_n(&cpu_caches[cpu].counts[bin], __ATOMIC_RELAXED);
+            sum += bytes ? count * (bin + 1) * 8 : count;
+        }
+    }
+    return sum;
 }
 
 
@@ -611,58 +3434,48 @@ size_t AllocedBlocksList::size_meta_data() {
                                                       */
 ////////////////////////////////////////////////////////
 
-AllocedBlocksList allocatedBlocks = AllocedBlocksList();
-
 void* smalloc(size_t size){
-    alignFirstUse();
-
     if(size == 0 || size > MAX_SIZE){
         return NULL;
     }
 
-    if (size >= LARGE_BLOCK) {
-        return allocatedBlocks.insertLargeBlock(size);
-    }
-    ALIGN_SIZE(size);
-    void* new_block = allocatedBlocks.allocateFreeBlock(size);
-
-    if(new_block == NULL){
-        new_block = allocatedBlocks.insertBlock(size);
+    if (USE_CPU_CACHE) {
+        void* cached = cpuCacheAllocate(size);
+        if (cached != NULL) {
+            return cached;
+        }
     }
-    else if (allocatedBlocks.data_to_meta(new_block)->size - size >= (MIN_SPLIT_SIZE + allocatedBlocks.size_meta_data())) {
-        new_block = allocatedBlocks.SplitAndInsert(size, allocatedBlocks.data_to_meta(new_block));
+    else if (USE_THREAD_CACHE) {
+        void* cached = threadCache.allocateBlock(size);
+        if (cached != NULL) {
+            return cached;
+        }
     }
-
-    return new_block;
+    return heapAllocate(size, 0);
 }
 
 void* scalloc(size_t num, size_t size){
-    alignFirstUse();
     size_t total_size = num * size;
 
     if(total_size == 0 || total_size > MAX_SIZE){
         return NULL;
     }
 
-    if (total_size >= LARGE_BLOCK) {
-        return allocatedBlocks.insertLargeBlock(total_size, /*is_scalloc=*/1);
+    void* new_block = NULL;
+    if (USE_CPU_CACHE) {
+        new_block = cpuCacheAllocate(total_size);
     }
-    ALIGN_SIZE(total_size);
-    void* new_block = allocatedBlocks.allocateFreeBlock(total_size);
-
-    if(new_block == NULL){
-        new_block = allocatedBlocks.insertBlock(total_size);
+    else if (USE_THREAD_CACHE) {
+        new_block = threadCache.allocateBlock(total_size);
     }
-    else if (allocatedBlocks.data_to_meta(new_block)->size - total_size >= (MIN_SPLIT_SIZE + allocatedBlocks.size_meta_data())) {
-        new_block = allocatedBlocks.SplitAndInsert(total_size, allocatedBlocks.data_to_meta(new_block));
+    if (new_block != NULL) {
+        std::memset(new_block, 0, total_size);
     }
-
-    if(new_block == NULL){
-        return NULL;
+    else {
+        // The heap only zeroes what may be dirty
+        new_block = heapAllocate(total_size, /*is_scalloc=*/1);
     }
 
-    std::memset(new_block, 0, total_size);
-
     return new_block;
 }
 
@@ -671,7 +3484,10 @@ void sfree(void* p){
         return;
     }
 
-    allocatedBlocks.releaseBlock(p);
+    if(USE_CPU_CACHE ? cpuCacheRelease(p) : (USE_THREAD_CACHE && threadCache.releaseBlock(p))){
+        return;
+    }
+    heapRelease(p);
 }
 
 void* srealloc(void* oldp, size_t size){
@@ -683,40 +3499,171 @@ void* srealloc(void* oldp, size_t size){
         return NULL;
     }
 
-    MallocMetadata* meta_data_ptr = allocatedBlocks.data_to_meta(oldp);
-    if(meta_data_ptr->size >= LARGE_BLOCK){
-        return allocatedBlocks.ReallocateLargeBlock(meta_data_ptr, size);
+    uint16_t entry = pageMap.lookup(oldp);
+    if(pageTier(entry) == PAGE_SLAB){
+        LockGuard guard(&heap_lock);
+        size_t old_size = slabAllocator.objectSize(oldp);
+        if(size <= old_size){
+            return oldp;
+        }
+        void* new_block = smalloc(size);
+        if(new_block == NULL){
+            return NULL;
+        }
+        memmove(new_block, oldp, old_size);
+        slabAllocator.releaseObject(oldp);
+        return new_block;
+    }
+
+    if(pageTier(entry) == PAGE_BUDDY){
+        LockGuard guard(&heap_lock);
+        ALIGN_SIZE(size);
+        return buddyAllocator.reallocateBlock(oldp, size);
+    }
+
+    if(USE_BUDDY_ALLOCATOR){
+        // In buddy mode everything outside the buddy heap was mmapped
+        if(pageTier(entry) != PAGE_MMAP){
+            exit(DEADBEEF);
+        }
+        LockGuard guard(&heap_lock);
+        LockGuard arena_guard(&allocatedBlocks.lock);
+        MallocMetadata* meta_data_ptr = allocatedBlocks.data_to_meta(oldp);
+        if(size >= LARGE_BLOCK){
+            return allocatedBlocks.ReallocateLargeBlock(meta_data_ptr, size);
+        }
+        // Small blocks belong to the buddy heap in this mode
+        void* new_block = heapAllocate(size, 0);
+        if(new_block == NULL){
+            return NULL;
+        }
+        copyMemory(new_block, oldp, size);
+        allocatedBlocks.releaseLargeBlock(oldp);
+        return new_block;
+    }
+
+    AllocedBlocksList* arena = arenaOf(entry);
+    LockGuard guard(&arena->lock);
+    MallocMetadata* meta_data_ptr = arena->data_to_meta(oldp);
+    if(pageTier(entry) == PAGE_MMAP){
+        return arena->ReallocateLargeBlock(meta_data_ptr, size);
     }
     else{
         ALIGN_SIZE(size);
-        return allocatedBlocks.ReallocateRegularBlock(meta_data_ptr, size);
+        return arena->ReallocateRegularBlock(meta_data_ptr, size);
+    }
+}
+
+size_t cachedBlocks(){
+    size_t blocks = USE_CPU_CACHE ? cpuCacheSum(/*bytes=*/false) : 0;
+    for(int bin = 0; bin < TCACHE_NUM_BINS; bin++){
+        blocks += central_lists[bin].count.load(std::memory_order_relaxed);
+    }
+    for(ThreadCache* cache = thread_caches; cache != nullptr; cache = cache->next){
+        blocks += cache->cached_blocks.load(std::memory_order_relaxed);
+    }
+    return blocks;
+}
+
+size_t cachedBytes(){
+    size_t bytes = central_bytes.load(std::memory_order_relaxed);
+    if(USE_CPU_CACHE){
+        bytes += cpuCacheSum(/*bytes=*/true);
     }
+    for(ThreadCache* cache = thread_caches; cache != nullptr; cache = cache->next){
+        bytes += cache->cached_bytes.load(std::memory_order_relaxed);
+    }
+    return bytes;
+}
+
+size_t _num_large_cache_hits(){
+    LockGuard guard(&largeBlockCache.lock);
+    return largeBlockCache.hits;
+}
+
+size_t _num_large_cache_misses(){
+    LockGuard guard(&largeBlockCache.lock);
+    return largeBlockCache.misses;
+}
+
+size_t _num_unused_top_bytes(){
+    return arenasSum(&AllocedBlocksList::num_unused_top_bytes);
+}
+
+size_t _num_hugetlb_blocks(){
+    return num_hugetlb_blocks.load(std::memory_order_relaxed);
+}
+
+size_t _num_thp_blocks(){
+    return num_thp_blocks.load(std::memory_order_relaxed);
+}
+
+size_t _num_base_page_blocks(){
+    return num_base_page_blocks.load(std::memory_order_relaxed);
 }
 
 size_t _num_free_blocks(){
-    return allocatedBlocks.num_free_blocks();
+    LockGuard guard(&heap_lock);
+    return arenasSum(&AllocedBlocksList::num_free_blocks) + slabAllocator.num_free_blocks() + buddyAllocator.num_free_blocks() + cachedBlocks();
 }
 
 size_t _num_free_bytes(){
-    return allocatedBlocks.num_free_bytes();
+    LockGuard guard(&heap_lock);
+    return arenasSum(&AllocedBlocksList::num_free_bytes) + slabAllocator.num_free_bytes() + buddyAllocator.num_free_bytes() + cachedBytes();
 }
 
 size_t _num_allocated_blocks(){
-    return allocatedBlocks.num_allocated_blocks();
+    LockGuard guard(&heap_lock);
+    return arenasSum(&AllocedBlocksList::num_allocated_blocks) + slabAllocator.num_allocated_blocks() + buddyAllocator.num_allocated_blocks();
 }
 
 size_t _num_allocated_bytes(){
-    return allocatedBlocks.num_allocated_bytes();
+    LockGuard guard(&heap_lock);
+    return arenasSum(&AllocedBlocksList::num_allocated_bytes) + slabAllocator.num_allocated_bytes() + buddyAllocator.num_allocated_bytes();
 }
 
 size_t _num_meta_data_bytes(){
-    return allocatedBlocks.num_meta_data_bytes();
+    LockGuard guard(&heap_lock);
+    return arenasSum(&AllocedBlocksList::num_meta_data_bytes) + slabAllocator.num_meta_data_bytes() + buddyAllocator.num_meta_data_bytes();
 }
 
 size_t _size_meta_data(){
     return allocatedBlocks.size_meta_data();
 }
 
+// Every arena stays locked until all of them are read, so the heap totals
+// describe a single moment. Thread caches are read as they are.
+struct smallinfo smallinfo(){
+    struct smallinfo info = {};
+    LockGuard guard(&heap_lock);
+    AllocedBlocksList* locked[ARENA_MAX];
+    int num_locked = 0;
+    for(int i = 0; i < ARENA_MAX; i++){
+        AllocedBlocksList* arena = arenas[i].load(std::memory_order_acquire);
+        if(arena == nullptr){
+            continue;
+        }
+        pthread_mutex_lock(&arena->lock);
+        locked[num_locked++] = arena;
+        arena->DrainRemoteFrees();
+        info.free_blocks += arena->num_free_blocks();
+        info.free_bytes += arena->num_free_bytes();
+        info.allocated_blocks += arena->num_allocated_blocks();
+        info.allocated_bytes += arena->num_allocated_bytes();
+        info.meta_data_bytes += arena->num_meta_data_bytes();
+    }
+    info.free_blocks += slabAllocator.num_free_blocks() + buddyAllocator.num_free_blocks() + cachedBlocks();
+    info.free_bytes += slabAllocator.num_free_bytes() + buddyAllocator.num_free_bytes() + cachedBytes();
+    info.allocated_blocks += slabAllocator.num_allocated_blocks() + buddyAllocator.num_allocated_blocks();
+    info.allocated_bytes += slabAllocator.num_allocated_bytes() + buddyAllocator.num_allocated_bytes();
+    info.meta_data_bytes += slabAllocator.num_meta_data_bytes() + buddyAllocator.num_meta_data_bytes();
+    info.size_meta_data = allocatedBlocks.size_meta_data();
+    while(num_locked > 0){
+        pthread_mutex_unlock(&locked[--num_locked]->lock);
+    }
+    return info;
+}
+
 
 ////////////////////////////////////////////////////////
 /*
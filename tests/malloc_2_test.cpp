@@ -1,5 +1,6 @@
 #include "my_stdlib.h"
 #include <catch2/catch_test_macros.hpp>
+#include "verify_smallinfo.h"
 
 #include <unistd.h>
 
@@ -709,3 +710,57 @@ TEST_CASE("srealloc Max size", "[malloc2]")
     verify_blocks(1, MAX_ALLOCATION_SIZE, 1, MAX_ALLOCATION_SIZE);
     verify_size(base);
 }
+
+TEST_CASE("smallinfo", "[malloc2]")
+{
+    verify_smallinfo();
+    char *a = (char *)smalloc(10);
+    REQUIRE(a != nullptr);
+    char *b = (char *)smalloc(100);
+    REQUIRE(b != nullptr);
+    char *c = (char *)smalloc(1000);
+    REQUIRE(c != nullptr);
+    verify_smallinfo();
+
+    sfree(b);
+    verify_smallinfo();
+    a = (char *)srealloc(a, 50);
+    REQUIRE(a != nullptr);
+    verify_smallinfo();
+    c = (char *)srealloc(c, 3000);
+    REQUIRE(c != nullptr);
+    verify_smallinfo();
+
+    char *d = (char *)scalloc(10, 30);
+    REQUIRE(d != nullptr);
+    verify_smallinfo();
+
+    sfree(a);
+    sfree(c);
+    sfree(d);
+    verify_smallinfo();
+}
+
+TEST_CASE("smallinfo counts after reuse", "[malloc2]")
+{
+    char *a = (char *)smalloc(1000);
+    char *b = (char *)smalloc(1000);
+    char *c = (char *)smalloc(1000);
+    REQUIRE(a != nullptr);
+    REQUIRE(b != nullptr);
+    REQUIRE(c != nullptr);
+    verify_smallinfo_blocks(3, 3000, 0, 0);
+
+    sfree(b);
+    verify_smallinfo_blocks(3, 3000, 1, 1000);
+    // A smaller request takes the whole free block
+    char *d = (char *)smalloc(100);
+    REQUIRE(d == b);
+    verify_smallinfo_blocks(3, 3000, 0, 0);
+
+    sfree(a);
+    sfree(c);
+    verify_smallinfo_blocks(3, 3000, 2, 2000);
+    sfree(d);
+    verify_smallinfo_blocks(3, 3000, 3, 3000);
+}
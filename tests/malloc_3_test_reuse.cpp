@@ -325,3 +325,96 @@ TEST_CASE("Reuse two blocks sizes large", "[malloc3]")
     verify_blocks(1, 120 + 2 * _size_meta_data(), 1, 120 + 2 * _size_meta_data());
     verify_size(base);
 }
+
+TEST_CASE("Reuse best fit", "[malloc3]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+
+    // Each free block is kept apart from the others by a live one
+    char *a = (char *)smalloc(304);
+    char *g1 = (char *)smalloc(16);
+    char *b = (char *)smalloc(112);
+    char *g2 = (char *)smalloc(16);
+    char *c = (char *)smalloc(208);
+    char *g3 = (char *)smalloc(16);
+    REQUIRE(a != nullptr);
+    REQUIRE(g1 != nullptr);
+    REQUIRE(b != nullptr);
+    REQUIRE(g2 != nullptr);
+    REQUIRE(c != nullptr);
+    REQUIRE(g3 != nullptr);
+    verify_blocks(6, 672, 0, 0);
+    verify_size(base);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    verify_blocks(6, 672, 3, 624);
+    verify_size(base);
+
+    char *d = (char *)smalloc(96);
+    REQUIRE(d == b);
+    verify_blocks(6, 672, 2, 512);
+    char *e = (char *)smalloc(160);
+    REQUIRE(e == c);
+    verify_blocks(6, 672, 1, 304);
+    char *f = (char *)smalloc(240);
+    REQUIRE(f == a);
+    verify_blocks(6, 672, 0, 0);
+    verify_size(base);
+
+    sfree(d);
+    sfree(e);
+    sfree(f);
+    sfree(g1);
+    sfree(g2);
+    sfree(g3);
+    verify_blocks(1, 672 + 5 * _size_meta_data(), 1, 672 + 5 * _size_meta_data());
+    verify_size(base);
+}
+
+TEST_CASE("Reuse best fit lowest address", "[malloc3]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+
+    char *a = (char *)smalloc(112);
+    char *g1 = (char *)smalloc(16);
+    char *b = (char *)smalloc(112);
+    char *g2 = (char *)smalloc(16);
+    char *c = (char *)smalloc(112);
+    char *g3 = (char *)smalloc(16);
+    REQUIRE(a != nullptr);
+    REQUIRE(g1 != nullptr);
+    REQUIRE(b != nullptr);
+    REQUIRE(g2 != nullptr);
+    REQUIRE(c != nullptr);
+    REQUIRE(g3 != nullptr);
+    verify_blocks(6, 384, 0, 0);
+    verify_size(base);
+
+    // Freed out of address order, equal sizes still come back lowest first
+    sfree(c);
+    sfree(a);
+    sfree(b);
+    verify_blocks(6, 384, 3, 336);
+
+    char *d = (char *)smalloc(112);
+    REQUIRE(d == a);
+    char *e = (char *)smalloc(112);
+    REQUIRE(e == b);
+    char *f = (char *)smalloc(112);
+    REQUIRE(f == c);
+    verify_blocks(6, 384, 0, 0);
+    verify_size(base);
+
+    sfree(d);
+    sfree(e);
+    sfree(f);
+    sfree(g1);
+    sfree(g2);
+    sfree(g3);
+    verify_blocks(1, 384 + 5 * _size_meta_data(), 1, 384 + 5 * _size_meta_data());
+    verify_size(base);
+}
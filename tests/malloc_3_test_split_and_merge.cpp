@@ -331,3 +331,71 @@ TEST_CASE("Merge with both blocks pad", "[malloc3]")
     verify_blocks(1, 80 + 4 * _size_meta_data(), 1, 80 + 4 * _size_meta_data());
     verify_size(base);
 }
+
+TEST_CASE("Best fit through split merge and realloc", "[malloc3]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    size_t meta = _size_meta_data();
+
+    char *a = (char *)smalloc(1024);
+    char *g1 = (char *)smalloc(16);
+    char *b = (char *)smalloc(512);
+    char *g2 = (char *)smalloc(16);
+    char *c = (char *)smalloc(256);
+    char *g3 = (char *)smalloc(16);
+    REQUIRE(a != nullptr);
+    REQUIRE(g1 != nullptr);
+    REQUIRE(b != nullptr);
+    REQUIRE(g2 != nullptr);
+    REQUIRE(c != nullptr);
+    REQUIRE(g3 != nullptr);
+    verify_blocks(6, 1840, 0, 0);
+    verify_size(base);
+
+    // Split: the rest of a stays free
+    sfree(a);
+    char *d = (char *)smalloc(64);
+    REQUIRE(d == a);
+    verify_blocks(7, 1840 - meta, 1, 960 - meta);
+    verify_size(base);
+
+    // c fits better than the rest of a
+    sfree(c);
+    verify_blocks(7, 1840 - meta, 2, 1216 - meta);
+    char *e = (char *)smalloc(208);
+    REQUIRE(e == c);
+    verify_blocks(7, 1840 - meta, 1, 960 - meta);
+    verify_size(base);
+
+    // Merge: the rest of a, g1 and b become one free block
+    sfree(b);
+    verify_blocks(7, 1840 - meta, 2, 1472 - meta);
+    sfree(g1);
+    verify_blocks(5, 1840 + meta, 1, 1488 + meta);
+    verify_size(base);
+
+    // Realloc: d grows into that block and splits off the rest
+    char *f = (char *)srealloc(d, 1008);
+    REQUIRE(f == d);
+    verify_blocks(5, 1840 + meta, 1, 544 + meta);
+    verify_size(base);
+
+    // e fits better than the rest of the merged block
+    sfree(e);
+    verify_blocks(5, 1840 + meta, 2, 800 + meta);
+    char *h = (char *)smalloc(240);
+    REQUIRE(h == c);
+    char *i = (char *)smalloc(496);
+    REQUIRE(i == f + 1008 + meta);
+    verify_blocks(5, 1840 + meta, 0, 0);
+    verify_size(base);
+
+    sfree(f);
+    sfree(h);
+    sfree(i);
+    sfree(g2);
+    sfree(g3);
+    verify_blocks(1, 1840 + 5 * meta, 1, 1840 + 5 * meta);
+    verify_size(base);
+}
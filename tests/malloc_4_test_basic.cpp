@@ -1,5 +1,6 @@
 #include "my_stdlib.h"
 #include <catch2/catch_test_macros.hpp>
+#include "verify_smallinfo.h"
 
 #include <unistd.h>
 
@@ -536,4 +537,70 @@ TEST_CASE("Large unaligned allocation", "[malloc3]")
     sfree(a);
     verify_blocks(0, 0, 0, 0);
     verify_size(base);
+}
+
+TEST_CASE("smallinfo", "[malloc3]")
+{
+    verify_smallinfo();
+    char *a = (char *)smalloc(10);
+    REQUIRE(a != nullptr);
+    char *b = (char *)smalloc(100);
+    REQUIRE(b != nullptr);
+    char *c = (char *)smalloc(1000);
+    REQUIRE(c != nullptr);
+    verify_smallinfo();
+
+    sfree(b);
+    verify_smallinfo();
+    a = (char *)srealloc(a, 50);
+    REQUIRE(a != nullptr);
+    verify_smallinfo();
+    c = (char *)srealloc(c, 3000);
+    REQUIRE(c != nullptr);
+    verify_smallinfo();
+
+    char *d = (char *)scalloc(10, 30);
+    REQUIRE(d != nullptr);
+    verify_smallinfo();
+
+    char *e = (char *)smalloc(MMAP_THRESHOLD);
+    REQUIRE(e != nullptr);
+    verify_smallinfo();
+    e = (char *)srealloc(e, MMAP_THRESHOLD * 2);
+    REQUIRE(e != nullptr);
+    verify_smallinfo();
+    sfree(e);
+    verify_smallinfo();
+
+    sfree(a);
+    sfree(c);
+    sfree(d);
+    verify_smallinfo();
+}
+
+TEST_CASE("smallinfo counts after split and merge", "[malloc3]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(1000);
+    char *b = (char *)smalloc(1000);
+    char *c = (char *)smalloc(1000);
+    REQUIRE(a != nullptr);
+    REQUIRE(b != nullptr);
+    REQUIRE(c != nullptr);
+    verify_smallinfo_blocks(3, 3000, 0, 0);
+
+    sfree(b);
+    verify_smallinfo_blocks(3, 3000, 1, 1000);
+    // a takes in b and its header
+    sfree(a);
+    verify_smallinfo_blocks(2, 3000 + meta, 1, 2000 + meta);
+
+    // The split gives a header back to the new block
+    char *d = (char *)smalloc(104);
+    REQUIRE(d == a);
+    verify_smallinfo_blocks(3, 3000, 1, 2000 - 104);
+
+    sfree(d);
+    sfree(c);
+    verify_smallinfo_blocks(1, 3000 + 2 * meta, 1, 3000 + 2 * meta);
 }
\ No newline at end of file
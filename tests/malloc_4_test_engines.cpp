@@ -0,0 +1,193 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+#include "verify_smallinfo.h"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// These cases don't depend on the heap layout, so they hold for every engine
+// malloc_4 can be built with, and are what the variant builds run.
+
+#define MMAP_THRESHOLD (128 * 1024)
+// What the allocator exits with on a pointer it doesn't own, as a status
+#define DEADBEEF_STATUS (0xdeadbeef & 0xff)
+#define NUM_SIZES 14
+
+// One of each tier: slab or cache bins, the heap, mmap and huge pages
+static const size_t sizes[NUM_SIZES] = {
+    1, 8, 16, 24, 40, 64, 100, 256, 1000, 4096, 20000, MMAP_THRESHOLD, 300000, 5 * 1024 * 1024,
+};
+
+// Once everything is freed, every block left is a free one
+#define verify_all_free()                                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        REQUIRE(_num_free_blocks() == _num_allocated_blocks());                                                        \
+        REQUIRE(_num_free_bytes() == _num_allocated_bytes());                                                          \
+    } while (0)
+
+static bool holds(const char *p, size_t size, char value)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (p[i] != value)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE("Engines mixed sizes", "[engines]")
+{
+    char *blocks[3][NUM_SIZES];
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < NUM_SIZES; i++)
+        {
+            blocks[round][i] = (char *)smalloc(sizes[i]);
+            REQUIRE(blocks[round][i] != nullptr);
+            memset(blocks[round][i], round * NUM_SIZES + i, sizes[i]);
+        }
+    }
+    verify_smallinfo();
+
+    // Free every other block and take the space again
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = round % 2; i < NUM_SIZES; i += 2)
+        {
+            sfree(blocks[round][i]);
+        }
+    }
+    verify_smallinfo();
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = round % 2; i < NUM_SIZES; i += 2)
+        {
+            blocks[round][i] = (char *)smalloc(sizes[i]);
+            REQUIRE(blocks[round][i] != nullptr);
+            memset(blocks[round][i], round * NUM_SIZES + i, sizes[i]);
+        }
+    }
+    verify_smallinfo();
+
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < NUM_SIZES; i++)
+        {
+            REQUIRE(holds(blocks[round][i], sizes[i], round * NUM_SIZES + i));
+        }
+    }
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < NUM_SIZES; i++)
+        {
+            sfree(blocks[round][i]);
+        }
+    }
+    verify_smallinfo();
+    verify_all_free();
+}
+
+TEST_CASE("Engines no overlap", "[engines]")
+{
+    char *blocks[200];
+    for (int i = 0; i < 200; i++)
+    {
+        blocks[i] = (char *)smalloc(sizes[i % (NUM_SIZES - 1)]);
+        REQUIRE(blocks[i] != nullptr);
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        for (int j = i + 1; j < 200; j++)
+        {
+            char *i_end = blocks[i] + sizes[i % (NUM_SIZES - 1)];
+            char *j_end = blocks[j] + sizes[j % (NUM_SIZES - 1)];
+            REQUIRE((i_end <= blocks[j] || j_end <= blocks[i]));
+        }
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        sfree(blocks[i]);
+    }
+    verify_smallinfo();
+    verify_all_free();
+}
+
+TEST_CASE("Engines scalloc reused memory", "[engines]")
+{
+    for (int i = 0; i < NUM_SIZES; i++)
+    {
+        char *a = (char *)smalloc(sizes[i]);
+        REQUIRE(a != nullptr);
+        memset(a, 0xff, sizes[i]);
+        sfree(a);
+
+        char *b = (char *)scalloc(1, sizes[i]);
+        REQUIRE(b != nullptr);
+        REQUIRE(holds(b, sizes[i], 0));
+        sfree(b);
+    }
+    verify_smallinfo();
+    verify_all_free();
+}
+
+TEST_CASE("Engines srealloc keeps content", "[engines]")
+{
+    char *a = (char *)smalloc(sizes[0]);
+    REQUIRE(a != nullptr);
+    memset(a, 7, sizes[0]);
+    size_t size = sizes[0];
+
+    // Up through every tier, then back down
+    for (int i = 1; i < 2 * NUM_SIZES - 1; i++)
+    {
+        size_t new_size = i < NUM_SIZES ? sizes[i] : sizes[2 * NUM_SIZES - 2 - i];
+        a = (char *)srealloc(a, new_size);
+        REQUIRE(a != nullptr);
+        REQUIRE(holds(a, size < new_size ? size : new_size, 7));
+        memset(a, 7, new_size);
+        size = new_size;
+        verify_smallinfo();
+    }
+    sfree(a);
+    verify_smallinfo();
+    verify_all_free();
+}
+
+// Runs f in a child process and returns its exit status
+template <typename F> static int exit_status(F f)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        f();
+        _exit(0);
+    }
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+TEST_CASE("Engines reject pointers they didn't hand out", "[engines]")
+{
+    static char outside[4096];
+    char on_stack[64] = {0};
+    char *big = (char *)smalloc(sizes[12]);
+    REQUIRE(big != nullptr);
+
+    REQUIRE(exit_status([&] { sfree(outside + 16); }) == DEADBEEF_STATUS);
+    REQUIRE(exit_status([&] { sfree(on_stack + 16); }) == DEADBEEF_STATUS);
+    REQUIRE(exit_status([&] { srealloc(outside + 16, 100); }) == DEADBEEF_STATUS);
+    REQUIRE(exit_status([&] { srealloc(on_stack + 16, 100); }) == DEADBEEF_STATUS);
+    // Only the first page of a mapping is where its pointer can lie
+    REQUIRE(exit_status([&] { sfree(big + 8192); }) == DEADBEEF_STATUS);
+    REQUIRE(exit_status([&] { sfree(big); }) == 0);
+
+    sfree(big);
+    verify_smallinfo();
+    verify_all_free();
+}
@@ -0,0 +1,184 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <string.h>
+#include <unistd.h>
+
+// Behaviour of the malloc_4 sbrk heap: its free index and how it grows.
+
+TEST_CASE("Segregated fit searches larger classes", "[malloc4]")
+{
+    char *small = (char *)smalloc(48);
+    char *g1 = (char *)smalloc(16);
+    char *mid = (char *)smalloc(1040);
+    char *g2 = (char *)smalloc(16);
+    char *big = (char *)smalloc(70000);
+    char *g3 = (char *)smalloc(16);
+    REQUIRE(small != nullptr);
+    REQUIRE(g1 != nullptr);
+    REQUIRE(mid != nullptr);
+    REQUIRE(g2 != nullptr);
+    REQUIRE(big != nullptr);
+    REQUIRE(g3 != nullptr);
+    void *top = sbrk(0);
+
+    sfree(small);
+    sfree(mid);
+    sfree(big);
+    REQUIRE(_num_free_blocks() == 3);
+
+    // Each request is served from the smallest class that has a block
+    char *a = (char *)smalloc(1000);
+    REQUIRE(a == mid);
+    char *b = (char *)smalloc(60000);
+    REQUIRE(b == big);
+    char *c = (char *)smalloc(40);
+    REQUIRE(c == small);
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_free_bytes() == 70000 - 60000 - _size_meta_data());
+
+    // The rest of the split block went back into its own class
+    char *d = (char *)smalloc(9000);
+    REQUIRE(d == b + 60000 + _size_meta_data());
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_free_bytes() == 70000 - 69000 - 2 * _size_meta_data());
+    REQUIRE(sbrk(0) == top);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    sfree(d);
+    sfree(g1);
+    sfree(g2);
+    sfree(g3);
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_allocated_blocks() == 1);
+}
+
+TEST_CASE("Boundary tags merge in any order", "[malloc4]")
+{
+    // Frees from both ends towards the middle, so every merge finds its
+    // previous neighbour through the boundary tag
+    char *blocks[16];
+    size_t total = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        blocks[i] = (char *)smalloc(32 + 16 * i);
+        REQUIRE(blocks[i] != nullptr);
+        total += 32 + 16 * i;
+    }
+    int order[16] = {0, 15, 2, 13, 4, 11, 6, 9, 1, 14, 3, 12, 5, 10, 7, 8};
+    for (int i = 0; i < 16; i++)
+    {
+        sfree(blocks[order[i]]);
+        if (i == 7)
+        {
+            REQUIRE(_num_free_blocks() == 8);
+        }
+    }
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_allocated_blocks() == 1);
+    REQUIRE(_num_free_bytes() == total + 15 * _size_meta_data());
+
+    char *all = (char *)smalloc(total);
+    REQUIRE(all == blocks[0]);
+    sfree(all);
+}
+
+TEST_CASE("Tiny blocks have room for the free links", "[malloc4]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(1);
+    char *b = (char *)smalloc(8);
+    REQUIRE(a != nullptr);
+    REQUIRE(b == a + 16 + meta);
+    REQUIRE(_num_allocated_bytes() == 32);
+
+    // So a freed one is in the free index and is found again
+    sfree(a);
+    for (int i = 0; i < 100; i++)
+    {
+        char *tiny = (char *)smalloc(8);
+        REQUIRE(tiny == a);
+        REQUIRE(smalloc(100) != nullptr);
+        sfree(tiny);
+    }
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_free_bytes() == 16);
+}
+
+static bool is_zero(const char *p, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (p[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE("scalloc zeroes what merged and split blocks left dirty", "[malloc4]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(1000);
+    char *b = (char *)smalloc(1000);
+    char *guard = (char *)smalloc(16);
+    REQUIRE(a != nullptr);
+    REQUIRE(b == a + 1000 + meta);
+    REQUIRE(guard != nullptr);
+    memset(a, 0xff, 1000);
+    memset(b, 0xff, 1000);
+
+    // The merged block includes b's old header
+    sfree(a);
+    sfree(b);
+    char *c = (char *)scalloc(2000 + meta, 1);
+    REQUIRE(c == a);
+    REQUIRE(is_zero(c, 2000 + meta));
+    memset(c, 0xff, 2000 + meta);
+    sfree(c);
+
+    // Both halves of a split are zeroed when they are handed out
+    char *d = (char *)scalloc(100, 8);
+    REQUIRE(d == a);
+    char *e = (char *)scalloc(1, 1200);
+    REQUIRE(e == d + 800 + meta);
+    REQUIRE(is_zero(d, 800));
+    REQUIRE(is_zero(e, 1200));
+
+    // Fresh memory from the top is zero as it is
+    char *f = (char *)scalloc(10, 100);
+    REQUIRE(f == guard + 16 + meta);
+    REQUIRE(is_zero(f, 1000));
+}
+
+TEST_CASE("srealloc moves overlapping blocks intact", "[malloc4]")
+{
+    size_t meta = _size_meta_data();
+    // Sizes around every width the copy loop works in
+    size_t sizes[] = {24, 40, 72, 136, 264, 1000, 4104, 65536 + 8, 100000};
+    for (size_t size : sizes)
+    {
+        char *a = (char *)smalloc(size);
+        char *b = (char *)smalloc(size);
+        // Keeps c from growing into the top instead
+        REQUIRE(smalloc(16) != nullptr);
+        REQUIRE(b == a + size + meta);
+        for (size_t i = 0; i < size; i++)
+        {
+            b[i] = (char)(i * 7 + 1);
+        }
+
+        // Merging with the free block before it moves b down by less than
+        // its own size
+        sfree(a);
+        char *c = (char *)srealloc(b, size + size / 2);
+        REQUIRE(c == a);
+        for (size_t i = 0; i < size; i++)
+        {
+            REQUIRE(c[i] == (char)(i * 7 + 1));
+        }
+    }
+}
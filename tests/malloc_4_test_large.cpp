@@ -0,0 +1,84 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <string.h>
+
+// Behaviour of the mmapped blocks above LARGE_BLOCK.
+
+static bool holds(const char *p, size_t size, char value)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (p[i] != value)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE("Large srealloc remaps in both directions", "[malloc4]")
+{
+    char *a = (char *)smalloc(1000000);
+    REQUIRE(a != nullptr);
+    memset(a, 3, 1000000);
+    size_t meta_bytes = _num_meta_data_bytes();
+
+    // Shrinking unmaps the tail and leaves the block where it is
+    char *b = (char *)srealloc(a, 200000);
+    REQUIRE(b == a);
+    REQUIRE(holds(b, 200000, 3));
+    REQUIRE(_num_allocated_blocks() == 1);
+    REQUIRE(_num_allocated_bytes() == 200000);
+
+    // Growing keeps the content, moved or not
+    char *c = (char *)srealloc(b, 30000000);
+    REQUIRE(c != nullptr);
+    REQUIRE(holds(c, 200000, 3));
+    memset(c, 4, 30000000);
+    REQUIRE(_num_allocated_blocks() == 1);
+    REQUIRE(_num_allocated_bytes() == 30000000);
+    REQUIRE(_num_meta_data_bytes() == meta_bytes);
+
+    sfree(c);
+    REQUIRE(_num_allocated_blocks() == 0);
+    REQUIRE(_num_allocated_bytes() == 0);
+}
+
+size_t _num_hugetlb_blocks();
+size_t _num_thp_blocks();
+size_t _num_base_page_blocks();
+
+TEST_CASE("Huge blocks are huge page aligned either way", "[malloc4]")
+{
+    size_t meta = _size_meta_data();
+    size_t hugetlb = _num_hugetlb_blocks();
+    size_t thp = _num_thp_blocks();
+
+    // hugetlb pages if any are reserved, otherwise an aligned mapping that
+    // THP can back, and the same from 2MB up
+    char *blocks[4];
+    size_t sizes[4] = {5000000, 5000000, 3000000, 2100000};
+    for (int i = 0; i < 4; i++)
+    {
+        blocks[i] = (char *)smalloc(sizes[i]);
+        REQUIRE(blocks[i] != nullptr);
+        REQUIRE((unsigned long)(blocks[i] - meta) % (2 * 1024 * 1024) == 0);
+        memset(blocks[i], 6, sizes[i]);
+    }
+    REQUIRE(_num_hugetlb_blocks() - hugetlb + _num_thp_blocks() - thp == 4);
+    REQUIRE(_num_base_page_blocks() == 0);
+
+    // Below 2MB nothing is counted
+    char *small = (char *)smalloc(1000000);
+    REQUIRE(small != nullptr);
+    REQUIRE(_num_hugetlb_blocks() - hugetlb + _num_thp_blocks() - thp == 4);
+
+    for (int i = 0; i < 4; i++)
+    {
+        REQUIRE(holds(blocks[i], sizes[i], 6));
+        sfree(blocks[i]);
+    }
+    sfree(small);
+    REQUIRE(_num_allocated_blocks() == 0);
+}
@@ -0,0 +1,43 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <thread>
+
+// Blocks that are freed by a thread other than the one that allocated them.
+
+TEST_CASE("Remote frees are merged by the owner", "[malloc4]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(100);
+    char *c = (char *)smalloc(100);
+    char *guard = (char *)smalloc(16);
+    REQUIRE(a != nullptr);
+    REQUIRE(b == a + 104 + meta);
+    REQUIRE(c == b + 104 + meta);
+    REQUIRE(guard != nullptr);
+
+    // This thread never allocates, so it has no arena and every free it
+    // makes waits for the owner. The second free of a is dropped.
+    std::thread worker([&] {
+        sfree(a);
+        sfree(a);
+        sfree(b);
+        sfree(c);
+    });
+    worker.join();
+    // So is a free by the owner of a block still waiting for it
+    sfree(c);
+
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_free_bytes() == 3 * 104 + 2 * meta);
+    REQUIRE(_num_allocated_blocks() == 2);
+
+    char *d = (char *)smalloc(3 * 104 + 2 * meta);
+    REQUIRE(d == a);
+    REQUIRE(_num_free_blocks() == 0);
+    sfree(d);
+    sfree(guard);
+    REQUIRE(_num_free_blocks() == 1);
+    REQUIRE(_num_allocated_blocks() == 1);
+}
@@ -0,0 +1,441 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+// Cases that only hold for one variant build. Each carries a hidden tag named
+// after the variant, so only that build runs it.
+
+TEST_CASE("Slab objects are packed without headers", "[.slab]")
+{
+    char *a = (char *)smalloc(24);
+    char *b = (char *)smalloc(24);
+    REQUIRE(a != nullptr);
+    REQUIRE(b == a + 24);
+
+    // A freed slot is the first one handed out again
+    sfree(a);
+    char *c = (char *)smalloc(20);
+    REQUIRE(c == a);
+
+    memset(b, 0xff, 24);
+    sfree(b);
+    char *d = (char *)scalloc(3, 8);
+    REQUIRE(d == b);
+    for (int i = 0; i < 24; i++)
+    {
+        REQUIRE(d[i] == 0);
+    }
+
+    // Shrinking stays in the slot, growing past the slab moves the data out
+    REQUIRE(srealloc(c, 16) == c);
+    memset(c, 5, 24);
+    char *e = (char *)srealloc(c, 200);
+    REQUIRE(e != nullptr);
+    REQUIRE(e != c);
+    for (int i = 0; i < 24; i++)
+    {
+        REQUIRE(e[i] == 5);
+    }
+    REQUIRE(smalloc(24) == c);
+}
+
+TEST_CASE("Buddy blocks split and merge by address", "[.buddy]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    REQUIRE(b != nullptr);
+    // Both halves of the first 256 byte block
+    REQUIRE((unsigned long)(a - meta) % 256 == 0);
+    REQUIRE(b == a + 128);
+    REQUIRE(_num_allocated_bytes() - _num_free_bytes() == 2 * (128 - meta));
+
+    char *c = (char *)smalloc(200);
+    REQUIRE(c == a + 256);
+
+    // Freeing the buddies merges them back into one max order block
+    size_t free_blocks = _num_free_blocks();
+    sfree(b);
+    REQUIRE(_num_free_blocks() == free_blocks + 1);
+    sfree(c);
+    sfree(a);
+    REQUIRE(_num_free_blocks() == _num_allocated_blocks());
+    REQUIRE(_num_free_bytes() == _num_allocated_bytes());
+
+    char *d = (char *)smalloc(1000);
+    REQUIRE(d == a);
+    REQUIRE(srealloc(d, 1024 - meta) == d);
+    sfree(d);
+}
+
+size_t cachedBlocks();
+size_t cachedBytes();
+
+TEST_CASE("Thread cache hands back the last block freed", "[.tcache]")
+{
+    // The first allocation of a size fills its bin with a whole batch
+    char *a = (char *)smalloc(40);
+    REQUIRE(a != nullptr);
+    size_t cached = cachedBlocks();
+    REQUIRE(cached > 0);
+
+    char *b = (char *)smalloc(40);
+    REQUIRE(cachedBlocks() == cached - 1);
+    sfree(a);
+    sfree(b);
+    REQUIRE(cachedBlocks() == cached + 1);
+    REQUIRE(cachedBytes() == (cached + 1) * 40);
+    REQUIRE(smalloc(40) == b);
+    REQUIRE(smalloc(33) == a);
+
+    // Other sizes have bins of their own
+    char *c = (char *)smalloc(64);
+    REQUIRE(c != a);
+    REQUIRE(c != b);
+    REQUIRE(cachedBlocks() > cached);
+}
+
+TEST_CASE("Threads get arenas of their own", "[.arenas]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    void *top = sbrk(0);
+
+    // The second thread's heap is a segment of its own, not the sbrk heap
+    char *b = nullptr;
+    char *c = nullptr;
+    std::thread worker([&] {
+        b = (char *)smalloc(100);
+        c = (char *)smalloc(100);
+    });
+    worker.join();
+    REQUIRE(b != nullptr);
+    REQUIRE((b + 100 <= a || b >= (char *)top));
+    REQUIRE(c == b + 104 + meta);
+    REQUIRE(sbrk(0) == top);
+
+    char *d = (char *)smalloc(100);
+    REQUIRE(d == a + 104 + meta);
+    sfree(a);
+    sfree(d);
+}
+
+TEST_CASE("CPU cache is shared by the threads of a CPU", "[.cpucache]")
+{
+    // Keep both threads on one CPU
+    cpu_set_t old_set;
+    cpu_set_t set;
+    REQUIRE(sched_getaffinity(0, sizeof(old_set), &old_set) == 0);
+    CPU_ZERO(&set);
+    CPU_SET(sched_getcpu(), &set);
+    REQUIRE(sched_setaffinity(0, sizeof(set), &set) == 0);
+
+    char *a = (char *)smalloc(40);
+    REQUIRE(a != nullptr);
+    size_t cached = cachedBlocks();
+    REQUIRE(cached > 0);
+    REQUIRE(cachedBytes() == cached * 40);
+
+    // A block another thread frees on this CPU is the next one handed out
+    char *b = nullptr;
+    std::thread worker([&] {
+        b = (char *)smalloc(40);
+        sfree(a);
+    });
+    worker.join();
+    REQUIRE(b != nullptr);
+    REQUIRE(b != a);
+    REQUIRE(cachedBlocks() == cached);
+    REQUIRE(smalloc(40) == a);
+    sfree(b);
+    REQUIRE(smalloc(33) == b);
+
+    REQUIRE(sched_setaffinity(0, sizeof(old_set), &old_set) == 0);
+}
+
+TEST_CASE("Blocks of an exited thread reach the central list", "[.tcache]")
+{
+    char *blocks[64];
+    std::thread worker([&] {
+        for (int i = 0; i < 64; i++)
+        {
+            blocks[i] = (char *)smalloc(72);
+        }
+        for (int i = 0; i < 64; i++)
+        {
+            sfree(blocks[i]);
+        }
+    });
+    worker.join();
+    // The thread cache flushed everything it held when the thread exited
+    size_t cached = cachedBlocks();
+    REQUIRE(cached == 64);
+
+    // Another thread refills from the central list instead of the heap
+    char *a = (char *)smalloc(72);
+    bool found = false;
+    for (int i = 0; i < 64; i++)
+    {
+        found = found || a == blocks[i];
+    }
+    REQUIRE(found);
+    REQUIRE(cachedBlocks() == cached - 1);
+}
+
+size_t _num_large_cache_hits();
+size_t _num_large_cache_misses();
+
+TEST_CASE("Large cache reuses and expires mappings", "[.largecache]")
+{
+    char *a = (char *)smalloc(300000);
+    REQUIRE(a != nullptr);
+    sfree(a);
+
+    // A mapping up to a quarter larger than asked for is taken as it is
+    size_t hits = _num_large_cache_hits();
+    char *b = (char *)smalloc(260000);
+    REQUIRE(b == a);
+    REQUIRE(_num_large_cache_hits() == hits + 1);
+    sfree(b);
+
+    // Until it has sat in the cache through enough other large requests
+    char *c = (char *)smalloc(1000000);
+    for (int i = 0; i < 200; i++)
+    {
+        sfree(c);
+        c = (char *)smalloc(1000000);
+        REQUIRE(c != nullptr);
+    }
+    size_t misses = _num_large_cache_misses();
+    char *d = (char *)smalloc(300000);
+    REQUIRE(d != nullptr);
+    REQUIRE(_num_large_cache_misses() == misses + 1);
+    sfree(c);
+    sfree(d);
+}
+
+TEST_CASE("Large blocks grow into their headroom in place", "[.headroom]")
+{
+    char *a = (char *)smalloc(200000);
+    REQUIRE(a != nullptr);
+    memset(a, 9, 200000);
+    size_t meta_bytes = _num_meta_data_bytes();
+
+    // Up to twice the size stays where it is
+    char *b = (char *)srealloc(a, 390000);
+    REQUIRE(b == a);
+    for (int i = 0; i < 200000; i++)
+    {
+        REQUIRE(b[i] == 9);
+    }
+    memset(b, 9, 390000);
+    REQUIRE(_num_allocated_bytes() == 390000);
+    REQUIRE(_num_meta_data_bytes() == meta_bytes);
+
+    // Past the headroom the block moves
+    char *c = (char *)srealloc(b, 1000000);
+    REQUIRE(c != nullptr);
+    REQUIRE(c != a);
+    for (int i = 0; i < 390000; i++)
+    {
+        REQUIRE(c[i] == 9);
+    }
+    sfree(c);
+    REQUIRE(_num_allocated_bytes() == 0);
+}
+
+// Pages of [p, p + length) that are resident
+static size_t residentPages(char *p, size_t length)
+{
+    unsigned char vec[1024];
+    REQUIRE(mincore(p, length, vec) == 0);
+    size_t resident = 0;
+    for (size_t i = 0; i < length / 4096; i++)
+    {
+        resident += vec[i] & 1;
+    }
+    return resident;
+}
+
+TEST_CASE("Spans are purged once a megabyte is dirty", "[.span]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(300000);
+    char *b = (char *)smalloc(800000);
+    REQUIRE(a != nullptr);
+    size_t a_length = (300000 + meta + 4095) / 4096 * 4096;
+    REQUIRE(b == a + a_length);
+    memset(a, 1, 300000);
+    memset(b, 1, 800000);
+
+    // The first page of a free run holds its links, the rest is left alone
+    // until the free pages around it add up to the threshold
+    char *a_pages = a - meta + 4096;
+    size_t a_pages_length = a_length - 4096;
+    sfree(a);
+    REQUIRE(residentPages(a_pages, a_pages_length) == a_pages_length / 4096);
+    sfree(b);
+    REQUIRE(residentPages(a_pages, a_pages_length) == 0);
+
+    // The run is clean now, so a small release next to it isn't purged
+    char *c = (char *)smalloc(300000);
+    REQUIRE(c == a);
+    memset(c, 1, 300000);
+    sfree(c);
+    REQUIRE(residentPages(a_pages, a_pages_length) == a_pages_length / 4096);
+
+    // Blocks of 2MB or more get a huge page aligned mapping of their own
+    char *d = (char *)smalloc(3000000);
+    REQUIRE(d != nullptr);
+    REQUIRE((unsigned long)(d - meta) % (2 * 1024 * 1024) == 0);
+    sfree(d);
+}
+
+size_t _num_hugetlb_blocks();
+
+TEST_CASE("Huge pool runs are reused", "[.hugepool]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(5000000);
+    REQUIRE(a != nullptr);
+    memset(a, 2, 5000000);
+    REQUIRE((unsigned long)(a - meta) % (2 * 1024 * 1024) == 0);
+    bool pooled = _num_hugetlb_blocks() > 0;
+    sfree(a);
+    REQUIRE(_num_allocated_blocks() == 0);
+
+    // Without reserved huge pages the pool has nothing to keep
+    char *b = (char *)smalloc(5000000);
+    REQUIRE(b != nullptr);
+    if (pooled)
+    {
+        REQUIRE(b == a);
+    }
+    char *c = (char *)smalloc(5000000);
+    REQUIRE(c != nullptr);
+    REQUIRE((c + 5000000 <= b || b + 5000000 <= c));
+    sfree(b);
+    sfree(c);
+    REQUIRE(_num_allocated_blocks() == 0);
+    REQUIRE(_num_allocated_bytes() == 0);
+}
+
+TEST_CASE("THP heap moves the break to huge page boundaries", "[.thpheap]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    void *top = sbrk(0);
+    REQUIRE((unsigned long)top % (2 * 1024 * 1024) == 0);
+
+    // Blocks are carved from the step until it runs out
+    char *b = (char *)smalloc(100);
+    REQUIRE(b == a + 104 + meta);
+    char *c = (char *)smalloc(50000);
+    REQUIRE(c == b + 104 + meta);
+    REQUIRE(sbrk(0) == top);
+
+    char *d = (char *)smalloc(100000);
+    while ((char *)d + 100000 < (char *)top)
+    {
+        d = (char *)smalloc(100000);
+        REQUIRE(d != nullptr);
+    }
+    REQUIRE(sbrk(0) > top);
+    REQUIRE((unsigned long)sbrk(0) % (2 * 1024 * 1024) == 0);
+}
+
+size_t _num_unused_top_bytes();
+
+TEST_CASE("Chunked heap carves blocks from the unused top", "[.chunked]")
+{
+    size_t meta = _size_meta_data();
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    void *top = sbrk(0);
+    size_t unused = _num_unused_top_bytes();
+    REQUIRE(unused > 0);
+    REQUIRE(a + 104 + unused == top);
+
+    // Every block takes exactly its size off the top, the break stays put
+    for (int i = 0; i < 100; i++)
+    {
+        char *b = (char *)smalloc(100);
+        REQUIRE(b == a + (i + 1) * (104 + meta));
+        REQUIRE(_num_unused_top_bytes() == unused - (i + 1) * (104 + meta));
+    }
+    REQUIRE(sbrk(0) == top);
+    REQUIRE(_num_allocated_blocks() == 101);
+
+    // A request larger than what is left moves the break by a whole step
+    char *c = (char *)smalloc(unused);
+    REQUIRE(c != nullptr);
+    REQUIRE(sbrk(0) > top);
+    REQUIRE(_num_unused_top_bytes() > 0);
+}
+
+TEST_CASE("Segment heap leaves the program break alone", "[.nosbrk]")
+{
+    size_t meta = _size_meta_data();
+    void *top = sbrk(0);
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+
+    // Commits the segment further as the heap grows past each step
+    char *prev = a;
+    size_t prev_size = 104;
+    for (int i = 0; i < 100; i++)
+    {
+        char *b = (char *)smalloc(100000);
+        REQUIRE(b == prev + prev_size + meta);
+        memset(b, 1, 100000);
+        prev = b;
+        prev_size = 100000;
+    }
+    REQUIRE(sbrk(0) == top);
+    REQUIRE(_num_allocated_blocks() == 101);
+    REQUIRE(_num_allocated_bytes() == 104 + 100 * 100000);
+}
+
+TEST_CASE("Quick lists merge once they hold most of the free memory", "[.quick]")
+{
+    size_t meta = _size_meta_data();
+    char *big = (char *)smalloc(100000);
+    REQUIRE(smalloc(16) != nullptr);
+    char *blocks[1600];
+    for (int i = 0; i < 1600; i++)
+    {
+        blocks[i] = (char *)smalloc(64);
+        REQUIRE(blocks[i] != nullptr);
+    }
+    REQUIRE(blocks[1] == blocks[0] + 64 + meta);
+
+    // The same size comes back from its list, without merging its neighbours
+    sfree(blocks[0]);
+    sfree(blocks[1]);
+    REQUIRE(_num_free_blocks() == 2);
+    REQUIRE(smalloc(64) == blocks[1]);
+    sfree(blocks[1]);
+
+    // Parked blocks stay apart while the free index holds more than they do
+    sfree(big);
+    for (int i = 2; i < 1562; i++)
+    {
+        sfree(blocks[i]);
+    }
+    REQUIRE(_num_free_blocks() == 1 + 1562);
+    REQUIRE(_num_free_bytes() == 100000 + 1562 * 64);
+
+    // One more and they are merged into a single block
+    sfree(blocks[1562]);
+    REQUIRE(_num_free_blocks() == 2);
+    REQUIRE(_num_free_bytes() == 100000 + 1563 * 64 + 1562 * meta);
+    REQUIRE(smalloc(1563 * 64 + 1562 * meta) == blocks[0]);
+}
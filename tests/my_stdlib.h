@@ -15,4 +15,17 @@ size_t _num_allocated_bytes();
 size_t _num_meta_data_bytes();
 size_t _size_meta_data();
 
+/* All the statistics above, taken at once, like mallinfo2. */
+struct smallinfo
+{
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t allocated_blocks;
+    size_t allocated_bytes;
+    size_t meta_data_bytes;
+    size_t size_meta_data;
+};
+
+struct smallinfo smallinfo();
+
 #endif /* MY_STDLIB_H */
@@ -0,0 +1,32 @@
+#ifndef VERIFY_SMALLINFO_H
+#define VERIFY_SMALLINFO_H
+
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+/* smallinfo() agrees with the _num_* statistics. */
+#define verify_smallinfo()                                                                                             \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        struct smallinfo info = smallinfo();                                                                           \
+        REQUIRE(info.free_blocks == _num_free_blocks());                                                               \
+        REQUIRE(info.free_bytes == _num_free_bytes());                                                                 \
+        REQUIRE(info.allocated_blocks == _num_allocated_blocks());                                                     \
+        REQUIRE(info.allocated_bytes == _num_allocated_bytes());                                                       \
+        REQUIRE(info.meta_data_bytes == _num_meta_data_bytes());                                                       \
+        REQUIRE(info.size_meta_data == _size_meta_data());                                                             \
+    } while (0)
+
+/* smallinfo() reports exactly these counts, worked out by the test itself. */
+#define verify_smallinfo_blocks(alloc_blocks, alloc_bytes, fr_blocks, fr_bytes)                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        struct smallinfo info = smallinfo();                                                                           \
+        REQUIRE(info.allocated_blocks == (size_t)(alloc_blocks));                                                      \
+        REQUIRE(info.allocated_bytes == (size_t)(alloc_bytes));                                                        \
+        REQUIRE(info.free_blocks == (size_t)(fr_blocks));                                                              \
+        REQUIRE(info.free_bytes == (size_t)(fr_bytes));                                                                \
+        REQUIRE(info.meta_data_bytes == info.size_meta_data * (alloc_blocks));                                         \
+    } while (0)
+
+#endif /* VERIFY_SMALLINFO_H */